@@ -23,6 +23,10 @@ func main() {
 	case "run":
 		runMakeTarget(ctx, "build")
 		runQemu(ctx, config.QemuArgs)
+	case "bench":
+		runClean()
+		runMakeTarget(ctx, "bench")
+		runQemu(ctx, config.QemuArgs)
 	case "clean":
 		runClean()
 	case "make":
@@ -1,4 +1,5 @@
 #include "asm.h"
+#include "cpu.h"
 #include "memory.h"
 #include <types.h>
 
@@ -15,6 +16,14 @@ void *ext__alloc_pages(s64 count) {
   return zeroed_pages(count);
 }
 
+void ext__preempt_disable(void) {
+  preempt_disable();
+}
+
+void ext__preempt_enable(void) {
+  preempt_enable();
+}
+
 _Noreturn void ext__shutdown(void) {
   // Cause immediate shutdown when in a virtual machine
   // https://wiki.osdev.org/Shutdown
@@ -29,7 +38,7 @@ _Noreturn void ext__shutdown(void) {
 #define BUF_SIZE 200
 
 static _Atomic bool UseInterrupts;
-static _Atomic u8 LoggingMutex;
+static TicketLock LoggingLock;
 static char buffer[BUF_SIZE];
 static void serial__write(char a);
 
@@ -39,12 +48,11 @@ static s64 write_prefix_to_buffer(String out, sloc loc) {
 }
 
 void ext__log(sloc loc, s32 count, const any *args) {
-  if (a_load(&UseInterrupts)) {
+  if (a_load_rlx(&UseInterrupts)) {
     return;
   }
 
-  while (!Mutex__try_lock(&LoggingMutex))
-    pause();
+  TicketLock__lock(&LoggingLock);
 
   String out = Str__new(buffer, BUF_SIZE);
   s64 written = write_prefix_to_buffer(out, loc);
@@ -65,16 +73,15 @@ void ext__log(sloc loc, s32 count, const any *args) {
     serial__write(buffer[i]);
   serial__write('\n');
 
-  Mutex__unlock(&LoggingMutex);
+  TicketLock__unlock(&LoggingLock);
 }
 
 void ext__log_fmt(sloc loc, const char *fmt, s32 count, const any *args) {
-  if (a_load(&UseInterrupts)) {
+  if (a_load_rlx(&UseInterrupts)) {
     return;
   }
 
-  while (!Mutex__try_lock(&LoggingMutex))
-    pause();
+  TicketLock__lock(&LoggingLock);
 
   String out = Str__new(buffer, BUF_SIZE);
   s64 written = write_prefix_to_buffer(out, loc);
@@ -102,7 +109,7 @@ void ext__log_fmt(sloc loc, const char *fmt, s32 count, const any *args) {
     serial__write(buffer[i]);
   serial__write('\n');
 
-  Mutex__unlock(&LoggingMutex);
+  TicketLock__unlock(&LoggingLock);
 }
 
 // Largely copy-pasted from
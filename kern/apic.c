@@ -0,0 +1,140 @@
+#include "apic.h"
+#include "asm.h"
+#include "clock.h"
+#include "init.h"
+#include "interrupts.h"
+#include "memory.h"
+#include <basics.h>
+#include <macros.h>
+
+// Register offsets are from the Intel SDM, Vol. 3A, Section 10.4.1
+// https://wiki.osdev.org/APIC
+#define APIC_ID            0x020
+#define APIC_EOI           0x0b0
+#define APIC_SPURIOUS      0x0f0
+#define APIC_ICR_LOW       0x300
+#define APIC_ICR_HIGH      0x310
+#define APIC_LVT_TIMER     0x320
+#define APIC_TIMER_INITIAL 0x380
+#define APIC_TIMER_CURRENT 0x390
+#define APIC_TIMER_DIVIDE  0x3e0
+#define APIC_SW_ENABLE     (U32(1) << 8)
+#define APIC_ICR_PENDING   (U32(1) << 12)
+#define APIC_ICR_ASSERT    (U32(1) << 14)
+#define APIC_LVT_MASKED    (U32(1) << 16)
+#define APIC_LVT_PERIODIC  (U32(1) << 17)
+#define APIC_DIVIDE_BY_16  U32(0x3)
+#define IA32_APIC_BASE_MSR 0x1B
+#define IA32_APIC_BASE     U64(0xffffff000)
+
+// https://wiki.osdev.org/8259_PIC
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xa0
+#define PIC2_DATA    0xa1
+
+#define TIMER_CALIBRATION_MS 10
+
+static volatile u32 *LocalApic;
+
+// Local APIC timer ticks per millisecond, with the divider at 16. The timer's
+// frequency is the bus clock's, which nothing tells us directly.
+static u64 TimerPerMs;
+
+static inline u32 apic_read(u32 reg) {
+  return LocalApic[reg / sizeof(u32)];
+}
+
+static inline void apic_write(u32 reg, u32 value) {
+  LocalApic[reg / sizeof(u32)] = value;
+}
+
+static HANDLER Idt__ignore(ExceptionStackFrame *frame) {
+  (void)frame;
+}
+
+// Move the PIC's vectors out of the exception range and then mask everything;
+// all interrupts go through the local APIC instead.
+static void disable_pic(void) {
+  out8(PIC1_COMMAND, 0x11);
+  out8(PIC2_COMMAND, 0x11);
+  out8(PIC1_DATA, INT_PIC_BASE);
+  out8(PIC2_DATA, INT_PIC_BASE + 8);
+  out8(PIC1_DATA, 4);
+  out8(PIC2_DATA, 2);
+  out8(PIC1_DATA, 1);
+  out8(PIC2_DATA, 1);
+
+  out8(PIC1_DATA, 0xff);
+  out8(PIC2_DATA, 0xff);
+}
+
+// Let the timer count down from the top for a while, timed with the TSC, which
+// `clock__init` already measured against the PIT
+static void calibrate_timer(void) {
+  apic_write(APIC_TIMER_DIVIDE, APIC_DIVIDE_BY_16);
+  apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED);
+  apic_write(APIC_TIMER_INITIAL, ~U32(0));
+
+  const u64 end = asm_rdtsc() + TIMER_CALIBRATION_MS * tsc_per_ms();
+  while (asm_rdtsc() < end)
+    pause();
+
+  const u32 elapsed = ~U32(0) - apic_read(APIC_TIMER_CURRENT);
+  apic_write(APIC_TIMER_INITIAL, 0);
+
+  TimerPerMs = max(elapsed / TIMER_CALIBRATION_MS, 1);
+}
+
+void apic__init(void) {
+  disable_pic();
+
+  set_interrupt_handler(INT_PIC_BASE + 7, Idt__ignore);
+  set_interrupt_handler(INT_PIC_BASE + 15, Idt__ignore);
+  set_interrupt_handler(INT_APIC_SPURIOUS, Idt__ignore);
+
+  // Every core's local APIC lives at the same physical address, and each core
+  // sees its own.
+  const u64 base = cpuGetMSR(IA32_APIC_BASE_MSR) & IA32_APIC_BASE;
+  LocalApic = map_mmio(base, 1);
+  assert(LocalApic);
+
+  apic__init_core();
+  calibrate_timer();
+
+  log_fmt("local APIC INIT_COMPLETE (timer runs at %f kHz)", TimerPerMs);
+}
+
+void apic__init_core(void) {
+  apic_write(APIC_SPURIOUS, APIC_SW_ENABLE | INT_APIC_SPURIOUS);
+}
+
+u16 apic_id(void) {
+  return U16(apic_read(APIC_ID) >> 24);
+}
+
+void apic_send_ipi(u16 target, u8 vector) {
+  // The ICR is written in two halves, so don't let an interrupt handler on this
+  // core send an IPI in between.
+  const u64 flags = irq_save();
+
+  while (apic_read(APIC_ICR_LOW) & APIC_ICR_PENDING)
+    pause();
+
+  apic_write(APIC_ICR_HIGH, U32(target) << 24);
+  apic_write(APIC_ICR_LOW, APIC_ICR_ASSERT | vector);
+
+  irq_restore(flags);
+}
+
+void apic_eoi(void) {
+  apic_write(APIC_EOI, 0);
+}
+
+void apic_timer_start(u8 vector, u64 period_us) {
+  const u64 count = min(max(TimerPerMs * period_us / 1000, 1), U64(~U32(0)));
+
+  apic_write(APIC_TIMER_DIVIDE, APIC_DIVIDE_BY_16);
+  apic_write(APIC_LVT_TIMER, APIC_LVT_PERIODIC | vector);
+  apic_write(APIC_TIMER_INITIAL, U32(count));
+}
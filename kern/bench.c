@@ -0,0 +1,1230 @@
+#include "bench.h"
+#include "asm.h"
+#include "clock.h"
+#include "cpu.h"
+#include "multitasking.h"
+#include "thread.h"
+#include "timer.h"
+#include <basics.h>
+#include <macros.h>
+#include <sync.h>
+
+#define THROUGHPUT_CHAINS_PER_WORKER 4
+#define THROUGHPUT_CHAIN_LENGTH      4096
+#define BURST_COUNT                  65536
+#define FANOUT_BATCH                 64
+#define SHARING_WRITES               (1 << 20)
+#define LITMUS_ROUNDS                (1 << 16)
+#define LITMUS_TASKS                 (1 << 16)
+#define LOCK_ACQUISITIONS            (1 << 14)
+#define RWLOCK_WRITE_EVERY           64
+#define PARK_COUNT                   4096
+#define THREAD_YIELDS                (1 << 14)
+#define THREAD_CHURN_LENGTH          4096
+#define SPINNER_MS                   100
+#define SHORT_TASKS                  256
+#define BACKGROUND_PER_WORKER        256
+#define BACKGROUND_TASK_US           20
+#define CRITICAL_TASKS               256
+#define DEADLINE_TASKS               64
+#define DEADLINE_US                  1000
+#define TIMER_CHURN                  1024
+#define TIMER_TASKS                  256
+#define TIMER_STEP_US                1000
+#define PERIODIC_FIRES               16
+#define SLEEP_LOCKERS_PER_WORKER     2
+#define SLEEP_LOCK_ROUNDS            2048
+#define WAKEUP_ROUNDS                64
+#define WAKEUP_WAIT_MS               50
+#define PLACED_TASKS                 4096
+#define PAYLOAD_TASKS                4096
+#define PAYLOAD_BLOCK_EVERY          16
+#define PAYLOAD_POOLED_SIZE          192
+#define PAYLOAD_PAGES_SIZE           6000
+
+static TaskProgress throughput_begin(void *data, s64 size);
+static TaskProgress burst_begin(void *data, s64 size);
+static TaskProgress fanout_begin(void *data, s64 size);
+static TaskProgress packed_begin(void *data, s64 size);
+static TaskProgress padded_begin(void *data, s64 size);
+static TaskProgress mp_begin(void *data, s64 size);
+static TaskProgress sb_fenced_begin(void *data, s64 size);
+static TaskProgress sb_relaxed_begin(void *data, s64 size);
+static TaskProgress claims_begin(void *data, s64 size);
+static TaskProgress mutex_begin(void *data, s64 size);
+static TaskProgress ticket_begin(void *data, s64 size);
+static TaskProgress mcs_begin(void *data, s64 size);
+static TaskProgress rwlock_begin(void *data, s64 size);
+static TaskProgress park_begin(void *data, s64 size);
+static TaskProgress yield_begin(void *data, s64 size);
+static TaskProgress churn_begin(void *data, s64 size);
+static TaskProgress preempt_begin(void *data, s64 size);
+static TaskProgress priority_begin(void *data, s64 size);
+static TaskProgress timers_begin(void *data, s64 size);
+static TaskProgress sleep_lock_begin(void *data, s64 size);
+static TaskProgress wakeup_begin(void *data, s64 size);
+static TaskProgress placement_begin(void *data, s64 size);
+static TaskProgress external_payload_begin(void *data, s64 size);
+static TaskProgress inline_payload_begin(void *data, s64 size);
+static TaskProgress pooled_payload_begin(void *data, s64 size);
+static TaskProgress pages_payload_begin(void *data, s64 size);
+
+static TaskCode Benchmarks[] = {
+    throughput_begin,     burst_begin,         fanout_begin,           packed_begin,
+    padded_begin,         mp_begin,            sb_fenced_begin,        sb_relaxed_begin,
+    claims_begin,         mutex_begin,         ticket_begin,           mcs_begin,
+    rwlock_begin,         park_begin,          yield_begin,            churn_begin,
+    preempt_begin,        priority_begin,      timers_begin,           sleep_lock_begin,
+    wakeup_begin,         placement_begin,     external_payload_begin, inline_payload_begin,
+    pooled_payload_begin, pages_payload_begin,
+};
+
+// Per-core counters, either packed next to each other or each on its own cache
+// line. These are padded by hand, so that they stay padded in UNPADDED builds.
+typedef struct {
+  _Atomic s64 value;
+} PackedCounter;
+
+typedef struct {
+  _Alignas(CACHE_LINE) _Atomic s64 value;
+} PaddedCounter;
+
+static PackedCounter PackedCounters[CPU_MAX];
+static PaddedCounter PaddedCounters[CPU_MAX];
+
+static struct {
+  _Atomic s64 next;
+  u64 begin;
+  _Atomic s64 running;
+  s64 op_count;
+} BenchGlobals;
+
+// Shared state for the litmus tests. They check that the orderings used in the
+// kernel actually hold on the (virtual) hardware, by counting outcomes that the
+// memory model forbids; any nonzero count from a test that should pass is a bug.
+static struct {
+  CACHE_ALIGNED _Atomic s64 data;
+  CACHE_ALIGNED _Atomic s64 flag;
+  CACHE_ALIGNED _Atomic s64 x;
+  CACHE_ALIGNED _Atomic s64 y;
+  CACHE_ALIGNED _Atomic s64 arrived;
+  s64 results[2];
+  bool fenced;
+  s64 forbidden;
+} LitmusGlobals;
+
+static _Atomic u8 Claimed[LITMUS_TASKS];
+
+typedef enum { LockMutex, LockTicket, LockMcs, LockRw } LockKind;
+
+// Lock contention: 1, 2, 4, ... workers hammer one lock with a tiny critical
+// section, and each round logs the total acquisitions per second. The
+// reader-writer lock gets a read-mostly mix instead, with one write in every
+// RWLOCK_WRITE_EVERY acquisitions.
+static struct {
+  LockKind kind;
+  const char *name;
+  s64 contenders;
+  CACHE_ALIGNED _Atomic u8 mutex;
+  CACHE_ALIGNED TicketLock ticket;
+  CACHE_ALIGNED McsLock mcs;
+  CACHE_ALIGNED RwLock rw;
+  CACHE_ALIGNED s64 counter;
+  CACHE_ALIGNED _Atomic s64 arrived;
+} LockGlobals;
+
+static struct {
+  TaskSignal signal;
+  _Atomic s64 waiting;
+} ParkGlobals;
+
+static struct {
+  _Atomic s64 started;
+  _Atomic u64 worst;
+} PreemptGlobals;
+
+static struct {
+  _Atomic u64 worst_wait;
+  _Atomic u64 worst_lateness;
+  s64 promotions; // from before the benchmark started
+} PriorityGlobals;
+
+static struct {
+  SleepLock lock;
+  s64 counter; // under `lock`
+  s64 sleeps;  // from before the benchmark started
+} SleepLockGlobals;
+
+static struct {
+  _Atomic u64 total;
+  _Atomic u64 worst;
+  _Atomic s64 done;
+  s64 wakeups; // from before the benchmark started
+} WakeupGlobals;
+
+static struct {
+  _Atomic s64 on_target;
+} PlacementGlobals;
+
+// A copied payload starts with its task's seed, and every byte after that is
+// derived from it, so a payload that got mixed up or overwritten shows up
+typedef struct {
+  s64 seed;
+  u8 bytes[TASK_INLINE_SIZE - sizeof(s64)];
+} InlinePayload;
+
+static struct {
+  TaskPayload kind;
+  TaskSignal signal;
+  _Atomic s64 blocked;
+  _Atomic s64 corrupt;
+  u8 scratch[PAYLOAD_PAGES_SIZE];
+} PayloadGlobals;
+
+static struct {
+  Timer churn[TIMER_CHURN];
+  Timer periodic;
+  _Atomic s64 periodic_fires;
+  _Atomic u64 worst_lateness;
+  _Atomic s64 early;
+  u64 churn_cycles;
+} TimerBenchGlobals;
+
+static void next_benchmark(void) {
+  const s64 index = a_add(&BenchGlobals.next, 1);
+  if (index >= (s64)(sizeof(Benchmarks) / sizeof(Benchmarks[0]))) return;
+
+  assert(add_task_inner((TaskData){.code = Benchmarks[index]}));
+}
+
+static void bench_finished(const char *name) {
+  const u64 cycles = asm_rdtsc() - BenchGlobals.begin;
+  const u64 count = (u64)BenchGlobals.op_count;
+
+  log_fmt("bench %f: %f ops in %fns (%f ops/s)", name, count, tsc_to_ns(cycles),
+          count * 1000 * tsc_per_ms() / max(cycles, 1));
+
+  next_benchmark();
+}
+
+void bench__run(void) {
+  next_benchmark();
+}
+
+// Every task in a chain queues the next one, so the queues never run dry and
+// the whole cost is in add_task and the worker loop.
+static TaskProgress throughput_chain(void *data, s64 size) {
+  (void)size;
+
+  const s64 remaining = (s64)data;
+  if (remaining > 0) {
+    assert(add_task(throughput_chain, remaining - 1, 0));
+    return Done;
+  }
+
+  if (a_add(&BenchGlobals.running, -1) == 1) bench_finished("throughput");
+  return Done;
+}
+
+static TaskProgress throughput_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  const s64 chains = THROUGHPUT_CHAINS_PER_WORKER * task_worker_count();
+  BenchGlobals.op_count = chains * (THROUGHPUT_CHAIN_LENGTH + 1);
+  a_store(&BenchGlobals.running, chains);
+  BenchGlobals.begin = asm_rdtsc();
+
+  RANGE(S64(0), chains) {
+    assert(add_task(throughput_chain, S64(THROUGHPUT_CHAIN_LENGTH), 0));
+  }
+
+  return Done;
+}
+
+static TaskProgress burst_task(void *data, s64 size) {
+  (void)data, (void)size;
+
+  if (a_add(&BenchGlobals.running, -1) != 1) return Done;
+
+  const TaskStats stats = task_stats();
+  log_fmt("bench burst: %f overflowed to the injector, which peaked at %f (%f backpressure events)",
+          stats.overflows, stats.injector_peak, stats.backpressure_events);
+  bench_finished("burst");
+  return Done;
+}
+
+// Submit far more tasks at once than a deque can hold, so most of them have to
+// go through the injector
+static TaskProgress burst_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  BenchGlobals.op_count = BURST_COUNT;
+  a_store(&BenchGlobals.running, BURST_COUNT);
+  BenchGlobals.begin = asm_rdtsc();
+
+  RANGE(0, BURST_COUNT) {
+    assert(add_task(burst_task));
+  }
+
+  return Done;
+}
+
+static TaskProgress fanout_task(void *data, s64 size) {
+  (void)data, (void)size;
+
+  if (a_add(&BenchGlobals.running, -1) == 1) bench_finished("fanout");
+  return Done;
+}
+
+// Same as the burst, but submitted in batches with `add_tasks`
+static TaskProgress fanout_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  TaskData batch[FANOUT_BATCH];
+  FOR_PTR(batch, FANOUT_BATCH) {
+    *it = (TaskData){.code = fanout_task};
+  }
+
+  BenchGlobals.op_count = BURST_COUNT;
+  a_store(&BenchGlobals.running, BURST_COUNT);
+  BenchGlobals.begin = asm_rdtsc();
+
+  REPEAT(BURST_COUNT / FANOUT_BATCH) {
+    assert(add_tasks(batch, FANOUT_BATCH));
+  }
+
+  return Done;
+}
+
+// Every worker hammers the counter for the core it's running on. The only
+// difference between the two runs is whether the counters share cache lines.
+static TaskProgress packed_task(void *data, s64 size) {
+  (void)data, (void)size;
+
+  _Atomic s64 *counter = &PackedCounters[cpu_index()].value;
+  REPEAT(SHARING_WRITES) {
+    a_add(counter, 1);
+  }
+
+  if (a_add(&BenchGlobals.running, -1) == 1) bench_finished("false sharing (packed)");
+  return Done;
+}
+
+static TaskProgress padded_task(void *data, s64 size) {
+  (void)data, (void)size;
+
+  _Atomic s64 *counter = &PaddedCounters[cpu_index()].value;
+  REPEAT(SHARING_WRITES) {
+    a_add(counter, 1);
+  }
+
+  if (a_add(&BenchGlobals.running, -1) == 1) bench_finished("false sharing (padded)");
+  return Done;
+}
+
+static void sharing_begin(TaskCode code) {
+  const s64 workers = task_worker_count();
+  BenchGlobals.op_count = workers * SHARING_WRITES;
+  a_store(&BenchGlobals.running, workers);
+  BenchGlobals.begin = asm_rdtsc();
+
+  // One writer placed on each worker, so they really do run at the same time.
+  // In chunks, since a batch for every possible core wouldn't fit on the stack.
+  TaskData batch[FANOUT_BATCH];
+  for (s64 begin = 0; begin < workers; begin += FANOUT_BATCH) {
+    const s64 count = min(workers - begin, S64(FANOUT_BATCH));
+    RANGE(S64(0), count) {
+      batch[it] = (TaskData){.code = code, .placement = PlaceOnWorker, .worker = U16(begin + it)};
+    }
+
+    assert(add_tasks(batch, count));
+  }
+}
+
+static TaskProgress packed_begin(void *data, s64 size) {
+  (void)data, (void)size;
+  sharing_begin(packed_task);
+  return Done;
+}
+
+static TaskProgress padded_begin(void *data, s64 size) {
+  (void)data, (void)size;
+  sharing_begin(padded_task);
+  return Done;
+}
+
+static void litmus_finished(const char *name, s64 rounds) {
+  if (a_add(&BenchGlobals.running, -1) != 1) return;
+
+  log_fmt("litmus %f: %f forbidden outcomes in %f rounds", name, LitmusGlobals.forbidden, rounds);
+  bench_finished(name);
+}
+
+// The two-sided tests spin waiting on each other, so they need two workers
+static bool litmus_start(TaskCode first, TaskCode second) {
+  if (task_worker_count() < 2) {
+    log_fmt("litmus tests need at least 2 cores, skipping");
+    next_benchmark();
+    return false;
+  }
+
+  a_store(&LitmusGlobals.data, 0);
+  a_store(&LitmusGlobals.flag, 0);
+  a_store(&LitmusGlobals.x, 0);
+  a_store(&LitmusGlobals.y, 0);
+  a_store(&LitmusGlobals.arrived, 0);
+  LitmusGlobals.forbidden = 0;
+
+  BenchGlobals.op_count = LITMUS_ROUNDS;
+  a_store(&BenchGlobals.running, 2);
+  BenchGlobals.begin = asm_rdtsc();
+
+  TaskData tasks[] = {{.code = first, .data = (void *)0}, {.code = second, .data = (void *)1}};
+  assert(add_tasks(tasks, 2));
+  return true;
+}
+
+// Message passing: a reader that acquires the flag has to see the data that
+// was written before the flag was released.
+static TaskProgress mp_writer(void *data, s64 size) {
+  (void)data, (void)size;
+
+  for (s64 round = 1; round <= LITMUS_ROUNDS; round++) {
+    a_store_rlx(&LitmusGlobals.data, round);
+    a_store_rel(&LitmusGlobals.flag, round);
+  }
+
+  litmus_finished("message passing", LITMUS_ROUNDS);
+  return Done;
+}
+
+static TaskProgress mp_reader(void *data, s64 size) {
+  (void)data, (void)size;
+
+  s64 flag = 0;
+  while (flag < LITMUS_ROUNDS) {
+    flag = a_load_acq(&LitmusGlobals.flag);
+    if (a_load_rlx(&LitmusGlobals.data) < flag) LitmusGlobals.forbidden++;
+  }
+
+  litmus_finished("message passing", LITMUS_ROUNDS);
+  return Done;
+}
+
+static TaskProgress mp_begin(void *data, s64 size) {
+  (void)data, (void)size;
+  litmus_start(mp_writer, mp_reader);
+  return Done;
+}
+
+static void litmus_barrier(s64 phase) {
+  a_add(&LitmusGlobals.arrived, 1);
+  while (a_load(&LitmusGlobals.arrived) < 2 * phase)
+    pause();
+}
+
+// Store buffering: each side stores to its own variable and then loads the
+// other's. With a full fence in between, at least one side has to see the
+// other's store. Without it, x86 lets both loads finish first, so the relaxed
+// run is expected to find some; it's there to show the test can catch them.
+static TaskProgress sb_side(void *data, s64 size) {
+  (void)size;
+
+  const s64 side = (s64)data;
+  _Atomic s64 *mine = side ? &LitmusGlobals.y : &LitmusGlobals.x;
+  _Atomic s64 *theirs = side ? &LitmusGlobals.x : &LitmusGlobals.y;
+  const char *name =
+      LitmusGlobals.fenced ? "store buffering (fenced)" : "store buffering (relaxed)";
+
+  for (s64 round = 1; round <= LITMUS_ROUNDS; round++) {
+    a_store_rlx(mine, round);
+    if (LitmusGlobals.fenced) a_fence();
+    else
+      compiler_barrier();
+
+    LitmusGlobals.results[side] = a_load_rlx(theirs);
+    litmus_barrier(2 * round - 1);
+
+    if (side == 0 && LitmusGlobals.results[0] < round && LitmusGlobals.results[1] < round)
+      LitmusGlobals.forbidden++;
+
+    litmus_barrier(2 * round);
+  }
+
+  litmus_finished(name, LITMUS_ROUNDS);
+  return Done;
+}
+
+static TaskProgress sb_fenced_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  LitmusGlobals.fenced = true;
+  litmus_start(sb_side, sb_side);
+  return Done;
+}
+
+static TaskProgress sb_relaxed_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  LitmusGlobals.fenced = false;
+  litmus_start(sb_side, sb_side);
+  return Done;
+}
+
+// Every task has to run exactly once, no matter how the owner's pops and the
+// thieves' steals interleave.
+static TaskProgress claim_task(void *data, s64 size) {
+  (void)size;
+
+  a_add_rlx(&Claimed[(s64)data], 1);
+  if (a_add(&BenchGlobals.running, -1) != 1) return Done;
+
+  s64 wrong = 0;
+  RANGE(S64(0), LITMUS_TASKS) {
+    if (a_load_rlx(&Claimed[it]) != 1) wrong++;
+  }
+
+  log_fmt("litmus task claims: %f tasks ran other than exactly once, out of %f", wrong,
+          LITMUS_TASKS);
+  bench_finished("task claims");
+  return Done;
+}
+
+static TaskProgress claims_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  BenchGlobals.op_count = LITMUS_TASKS;
+  a_store(&BenchGlobals.running, LITMUS_TASKS);
+  BenchGlobals.begin = asm_rdtsc();
+
+  // Small batches, so that the other workers are stealing while this one is
+  // still pushing and popping
+  TaskData batch[FANOUT_BATCH];
+  for (s64 begin = 0; begin < LITMUS_TASKS; begin += FANOUT_BATCH) {
+    RANGE(S64(0), S64(FANOUT_BATCH)) {
+      batch[it] = (TaskData){.code = claim_task, .data = (void *)(begin + it)};
+    }
+
+    assert(add_tasks(batch, FANOUT_BATCH));
+  }
+
+  return Done;
+}
+
+static void lock_round(void);
+
+static TaskProgress lock_contender(void *data, s64 size) {
+  (void)data, (void)size;
+
+  // Wait for everyone, so the round measures contention and not stragglers
+  a_add(&LockGlobals.arrived, 1);
+  while (a_load(&LockGlobals.arrived) < LockGlobals.contenders)
+    pause();
+
+  REPEAT(LOCK_ACQUISITIONS) {
+    switch (LockGlobals.kind) {
+    case LockMutex:
+      while (!Mutex__try_lock(&LockGlobals.mutex))
+        pause();
+      LockGlobals.counter++;
+      Mutex__unlock(&LockGlobals.mutex);
+      break;
+
+    case LockTicket:
+      TICKET_CRITICAL(&LockGlobals.ticket) LockGlobals.counter++;
+      break;
+
+    case LockMcs:
+      MCS_CRITICAL(&LockGlobals.mcs) LockGlobals.counter++;
+      break;
+
+    case LockRw:
+      if (it % RWLOCK_WRITE_EVERY == 0) {
+        RwLock__write_lock(&LockGlobals.rw);
+        LockGlobals.counter++;
+        RwLock__write_unlock(&LockGlobals.rw);
+      } else {
+        RwLock__read_lock(&LockGlobals.rw, cpu_index());
+        assert(LockGlobals.counter >= 0);
+        RwLock__read_unlock(&LockGlobals.rw, cpu_index());
+      }
+      break;
+    }
+  }
+
+  if (a_add(&BenchGlobals.running, -1) != 1) return Done;
+
+  const u64 cycles = asm_rdtsc() - BenchGlobals.begin;
+  const s64 count = LockGlobals.contenders * LOCK_ACQUISITIONS;
+  const s64 writes = LockGlobals.kind == LockRw ? count / RWLOCK_WRITE_EVERY : count;
+  assert(LockGlobals.counter == writes, "lock %f lost updates: %f of %f", LockGlobals.name,
+         LockGlobals.counter, writes);
+
+  log_fmt("bench lock %f with %f cores: %f acquisitions/s", LockGlobals.name,
+          LockGlobals.contenders, (u64)count * 1000 * tsc_per_ms() / max(cycles, 1));
+
+  const s64 workers = task_worker_count();
+  if (LockGlobals.contenders == workers) {
+    next_benchmark();
+    return Done;
+  }
+
+  LockGlobals.contenders = min(LockGlobals.contenders * 2, workers);
+  lock_round();
+  return Done;
+}
+
+static void lock_round(void) {
+  LockGlobals.counter = 0;
+  a_store(&LockGlobals.arrived, 0);
+  a_store(&BenchGlobals.running, LockGlobals.contenders);
+  BenchGlobals.begin = asm_rdtsc();
+
+  RANGE(S64(0), LockGlobals.contenders) {
+    assert(add_task(lock_contender, 0, 0));
+  }
+}
+
+static void lock_begin(LockKind kind, const char *name) {
+  LockGlobals.kind = kind;
+  LockGlobals.name = name;
+  LockGlobals.contenders = 1;
+  lock_round();
+}
+
+static TaskProgress mutex_begin(void *data, s64 size) {
+  (void)data, (void)size;
+  lock_begin(LockMutex, "test-and-set");
+  return Done;
+}
+
+static TaskProgress ticket_begin(void *data, s64 size) {
+  (void)data, (void)size;
+  lock_begin(LockTicket, "ticket");
+  return Done;
+}
+
+static TaskProgress mcs_begin(void *data, s64 size) {
+  (void)data, (void)size;
+  lock_begin(LockMcs, "mcs");
+  return Done;
+}
+
+static TaskProgress rwlock_begin(void *data, s64 size) {
+  (void)data, (void)size;
+  lock_begin(LockRw, "rwlock");
+  return Done;
+}
+
+// Every task blocks on the same signal, and the last one to block sets it. Some
+// of them get parked and woken, and the ones that lose the race with the set
+// get re-queued right away.
+static TaskProgress park_task(void *data, s64 size) {
+  (void)data, (void)size;
+
+  if (!task_signal_is_set(&ParkGlobals.signal)) {
+    if (a_add(&ParkGlobals.waiting, 1) == PARK_COUNT - 1) task_signal_set(&ParkGlobals.signal);
+    return task_block_on(&ParkGlobals.signal);
+  }
+
+  if (a_add(&BenchGlobals.running, -1) != 1) return Done;
+
+  log_fmt("bench park and wake: %f tasks parked", task_stats().parks);
+  bench_finished("park and wake");
+  return Done;
+}
+
+static TaskProgress park_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  task_signal_reset(&ParkGlobals.signal);
+  a_store(&ParkGlobals.waiting, 0);
+
+  BenchGlobals.op_count = PARK_COUNT;
+  a_store(&BenchGlobals.running, PARK_COUNT);
+  BenchGlobals.begin = asm_rdtsc();
+
+  TaskData batch[FANOUT_BATCH];
+  FOR_PTR(batch, FANOUT_BATCH) {
+    *it = (TaskData){.code = park_task};
+  }
+
+  REPEAT(PARK_COUNT / FANOUT_BATCH) {
+    assert(add_tasks(batch, FANOUT_BATCH));
+  }
+
+  return Done;
+}
+
+// One thread yielding over and over, with nothing else to run. Each yield is a
+// switch off the thread's stack, a trip through the task queue, and a switch
+// back.
+static void yield_thread(void *data) {
+  (void)data;
+
+  const u64 begin = asm_rdtsc();
+  REPEAT(THREAD_YIELDS) {
+    thread_yield();
+  }
+
+  const u64 cycles = asm_rdtsc() - begin;
+  log_fmt("bench thread yield: %f cycles per round trip", cycles / THREAD_YIELDS);
+  bench_finished("thread yield");
+}
+
+static TaskProgress yield_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  BenchGlobals.op_count = THREAD_YIELDS;
+  BenchGlobals.begin = asm_rdtsc();
+  assert(thread_spawn(yield_thread, NULL));
+  return Done;
+}
+
+// Chains of threads that each spawn the next one and exit, to measure creating
+// and tearing them down. Only a couple of stacks per chain are ever in use, so
+// after the first few, they all come out of the pool.
+static void churn_thread(void *data) {
+  const s64 remaining = (s64)data;
+  if (remaining > 0) {
+    assert(thread_spawn(churn_thread, (void *)(remaining - 1)));
+    return;
+  }
+
+  if (a_add(&BenchGlobals.running, -1) != 1) return;
+
+  const ThreadStats stats = thread_stats();
+  log_fmt("bench thread churn: %f threads on %f stacks", stats.spawned, stats.stacks);
+  bench_finished("thread churn");
+}
+
+static TaskProgress churn_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  const s64 chains = task_worker_count();
+  BenchGlobals.op_count = chains * (THREAD_CHURN_LENGTH + 1);
+  a_store(&BenchGlobals.running, chains);
+  BenchGlobals.begin = asm_rdtsc();
+
+  RANGE(S64(0), chains) {
+    assert(thread_spawn(churn_thread, (void *)S64(THREAD_CHURN_LENGTH)));
+  }
+
+  return Done;
+}
+
+static void preempt_finished(void) {
+  if (a_add(&BenchGlobals.running, -1) != 1) return;
+
+  log_fmt("bench preemption: short tasks waited at most %fns behind %fms spinners "
+          "(%f preemptions)",
+          tsc_to_ns(a_load(&PreemptGlobals.worst)), SPINNER_MS, thread_stats().preempted);
+  bench_finished("preemption");
+}
+
+static void record_worst(_Atomic u64 *worst, u64 value) {
+  u64 seen = a_load_rlx(worst);
+  while (value > seen && !a_cxweak_rlx(worst, &seen, value))
+    ;
+}
+
+static TaskProgress short_task(void *data, s64 size) {
+  (void)size;
+
+  record_worst(&PreemptGlobals.worst, asm_rdtsc() - (u64)data);
+  preempt_finished();
+  return Done;
+}
+
+// Threads that never yield, one per worker. Once they've all started, short
+// tasks get queued behind them; without preemption, those would wait for a
+// spinner to finish.
+static void spinner_thread(void *data) {
+  (void)data;
+
+  if (a_add(&PreemptGlobals.started, 1) == task_worker_count() - 1) {
+    // In chunks, since a full batch wouldn't fit on a thread's stack
+    TaskData batch[FANOUT_BATCH];
+    REPEAT(SHORT_TASKS / FANOUT_BATCH) {
+      FOR_PTR(batch, FANOUT_BATCH) {
+        *it = (TaskData){.code = short_task, .data = (void *)asm_rdtsc()};
+      }
+
+      assert(add_tasks(batch, FANOUT_BATCH));
+    }
+  }
+
+  const u64 end = asm_rdtsc() + SPINNER_MS * tsc_per_ms();
+  while (asm_rdtsc() < end)
+    pause();
+
+  preempt_finished();
+}
+
+static TaskProgress preempt_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  const s64 workers = task_worker_count();
+  a_store(&PreemptGlobals.started, 0);
+  a_store(&PreemptGlobals.worst, 0);
+
+  BenchGlobals.op_count = SHORT_TASKS;
+  a_store(&BenchGlobals.running, workers + SHORT_TASKS);
+  BenchGlobals.begin = asm_rdtsc();
+
+  RANGE(S64(0), workers) {
+    assert(thread_spawn(spinner_thread, NULL));
+  }
+
+  return Done;
+}
+
+static void priority_finished(void) {
+  if (a_add(&BenchGlobals.running, -1) != 1) return;
+
+  log_fmt("bench priorities: critical tasks waited at most %fns behind %f background tasks",
+          tsc_to_ns(a_load(&PriorityGlobals.worst_wait)),
+          BACKGROUND_PER_WORKER * task_worker_count());
+  log_fmt("bench priorities: tasks with a %fus deadline started at most %fns late (%f promoted)",
+          DEADLINE_US, tsc_to_ns(a_load(&PriorityGlobals.worst_lateness)),
+          task_stats().promotions - PriorityGlobals.promotions);
+  bench_finished("priorities");
+}
+
+static TaskProgress background_task(void *data, s64 size) {
+  (void)data, (void)size;
+
+  const u64 end = asm_rdtsc() + BACKGROUND_TASK_US * tsc_per_ms() / 1000;
+  while (asm_rdtsc() < end)
+    pause();
+
+  priority_finished();
+  return Done;
+}
+
+static TaskProgress critical_task(void *data, s64 size) {
+  (void)size;
+
+  record_worst(&PriorityGlobals.worst_wait, asm_rdtsc() - (u64)data);
+  priority_finished();
+  return Done;
+}
+
+static TaskProgress deadline_task(void *data, s64 size) {
+  (void)size;
+
+  const u64 now = asm_rdtsc(), deadline = (u64)data;
+  record_worst(&PriorityGlobals.worst_lateness, now > deadline ? now - deadline : 0);
+  priority_finished();
+  return Done;
+}
+
+// A backlog of background work, with critical tasks queued after it, which
+// should skip right past it. Some of the background tasks have a deadline, and
+// should get promoted once it passes instead of waiting their turn.
+static TaskProgress priority_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  const s64 background = BACKGROUND_PER_WORKER * task_worker_count();
+  a_store(&PriorityGlobals.worst_wait, 0);
+  a_store(&PriorityGlobals.worst_lateness, 0);
+  PriorityGlobals.promotions = task_stats().promotions;
+
+  BenchGlobals.op_count = background + CRITICAL_TASKS + DEADLINE_TASKS;
+  a_store(&BenchGlobals.running, BenchGlobals.op_count);
+  BenchGlobals.begin = asm_rdtsc();
+
+  // Queued first, so they're the oldest background tasks
+  const u64 deadline = asm_rdtsc() + DEADLINE_US * tsc_per_ms() / 1000;
+  TaskData batch[FANOUT_BATCH];
+  FOR_PTR(batch, DEADLINE_TASKS) {
+    *it = (TaskData){.code = deadline_task,
+                     .data = (void *)deadline,
+                     .priority = PriorityBackground,
+                     .deadline = deadline};
+  }
+  assert(add_tasks(batch, DEADLINE_TASKS));
+
+  FOR_PTR(batch, FANOUT_BATCH) {
+    *it = (TaskData){.code = background_task, .priority = PriorityBackground};
+  }
+  RANGE(S64(0), background / FANOUT_BATCH) {
+    assert(add_tasks(batch, FANOUT_BATCH));
+  }
+
+  RANGE(S64(0), S64(CRITICAL_TASKS)) {
+    const TaskData task = {
+        .code = critical_task, .data = (void *)asm_rdtsc(), .priority = PriorityCritical};
+    assert(add_tasks(&task, 1));
+  }
+
+  return Done;
+}
+
+static void timers_finished(void) {
+  if (a_add(&BenchGlobals.running, -1) != 1) return;
+
+  log_fmt("bench timers: %f cycles to start and cancel a timer", TimerBenchGlobals.churn_cycles);
+  log_fmt("bench timers: one-shot tasks ran at most %fns late, %f early; periodic fired %f times",
+          tsc_to_ns(a_load(&TimerBenchGlobals.worst_lateness)), a_load(&TimerBenchGlobals.early),
+          a_load(&TimerBenchGlobals.periodic_fires));
+  bench_finished("timers");
+}
+
+static TaskProgress delayed_task(void *data, s64 size) {
+  (void)size;
+
+  const u64 now = asm_rdtsc(), due = (u64)data;
+  if (now < due) a_add(&TimerBenchGlobals.early, 1);
+  else
+    record_worst(&TimerBenchGlobals.worst_lateness, now - due);
+
+  timers_finished();
+  return Done;
+}
+
+static TaskProgress periodic_task(void *data, s64 size) {
+  (void)data, (void)size;
+
+  if (a_add(&TimerBenchGlobals.periodic_fires, 1) != PERIODIC_FIRES - 1) return Done;
+
+  assert(timer_cancel(&TimerBenchGlobals.periodic));
+  timers_finished();
+  return Done;
+}
+
+// Starting and cancelling timers spread over every level of the wheel, then
+// tasks queued with a delay, checked against when they should have run, and a
+// periodic timer that cancels itself
+static TaskProgress timers_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  a_store(&TimerBenchGlobals.periodic_fires, 0);
+  a_store(&TimerBenchGlobals.worst_lateness, 0);
+  a_store(&TimerBenchGlobals.early, 0);
+
+  BenchGlobals.op_count = TIMER_TASKS + PERIODIC_FIRES;
+  a_store(&BenchGlobals.running, TIMER_TASKS + 1);
+  BenchGlobals.begin = asm_rdtsc();
+
+  // This core's wheel only turns between tasks, so none of these can fire
+  const TaskData never = {.code = delayed_task};
+  FOR_PTR(TimerBenchGlobals.churn, TIMER_CHURN) {
+    timer_start(it, never, U64(index) * U64(index) * 997, 0);
+  }
+
+  FOR_PTR(TimerBenchGlobals.churn, TIMER_CHURN) {
+    assert(timer_cancel(it));
+  }
+
+  TimerBenchGlobals.churn_cycles = (asm_rdtsc() - BenchGlobals.begin) / TIMER_CHURN;
+
+  RANGE(S64(0), S64(TIMER_TASKS)) {
+    const u64 delay = U64(it % 16 + 1) * TIMER_STEP_US;
+    const u64 due = asm_rdtsc() + delay * tsc_per_ms() / 1000;
+    assert(add_task_after(delay, (TaskData){.code = delayed_task, .data = (void *)due}));
+  }
+
+  timer_start(&TimerBenchGlobals.periodic, (TaskData){.code = periodic_task}, TIMER_STEP_US,
+              TIMER_STEP_US);
+  return Done;
+}
+
+// More threads than workers fighting over one SleepLock. Whoever loses sleeps
+// until the holder lets go, instead of spinning on a core that could be running
+// the holder.
+static void sleep_lock_thread(void *data) {
+  (void)data;
+
+  REPEAT(SLEEP_LOCK_ROUNDS) {
+    SleepLock__lock(&SleepLockGlobals.lock);
+    SleepLockGlobals.counter++;
+    SleepLock__unlock(&SleepLockGlobals.lock);
+  }
+
+  if (a_add(&BenchGlobals.running, -1) != 1) return;
+
+  assert(SleepLockGlobals.counter == BenchGlobals.op_count, "sleep lock lost an increment");
+  log_fmt("bench sleep lock: %f threads slept %f times",
+          SLEEP_LOCKERS_PER_WORKER * task_worker_count(),
+          thread_stats().lock_sleeps - SleepLockGlobals.sleeps);
+  bench_finished("sleep lock");
+}
+
+static TaskProgress sleep_lock_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  const s64 threads = SLEEP_LOCKERS_PER_WORKER * task_worker_count();
+  SleepLockGlobals.counter = 0;
+  SleepLockGlobals.sleeps = thread_stats().lock_sleeps;
+
+  BenchGlobals.op_count = threads * SLEEP_LOCK_ROUNDS;
+  a_store(&BenchGlobals.running, threads);
+  BenchGlobals.begin = asm_rdtsc();
+
+  RANGE(S64(0), threads) {
+    assert(thread_spawn(sleep_lock_thread, NULL));
+  }
+
+  return Done;
+}
+
+static TaskProgress wakeup_task(void *data, s64 size) {
+  (void)size;
+
+  const u64 waited = asm_rdtsc() - (u64)data;
+  a_add(&WakeupGlobals.total, waited);
+  record_worst(&WakeupGlobals.worst, waited);
+  a_add(&WakeupGlobals.done, 1);
+  return Done;
+}
+
+// Each round waits for every other worker to fall asleep, and then queues one
+// task from a thread that stays busy, so that it has to be picked up by a
+// worker that gets woken for it.
+static void wakeup_thread(void *data) {
+  (void)data;
+
+  const s64 others = task_worker_count() - 1;
+  RANGE(S64(0), S64(WAKEUP_ROUNDS)) {
+    const u64 give_up = asm_rdtsc() + WAKEUP_WAIT_MS * tsc_per_ms();
+    while (task_stats().sleeping < others && asm_rdtsc() < give_up)
+      pause();
+
+    assert(add_task(wakeup_task, asm_rdtsc(), 0));
+    while (a_load(&WakeupGlobals.done) <= it)
+      pause();
+  }
+
+  log_fmt("bench idle wakeup: queued tasks started after %fns on average, %fns at worst "
+          "(%f wakeups)",
+          tsc_to_ns(a_load(&WakeupGlobals.total) / WAKEUP_ROUNDS),
+          tsc_to_ns(a_load(&WakeupGlobals.worst)), task_stats().wakeups - WakeupGlobals.wakeups);
+  bench_finished("idle wakeup");
+}
+
+static TaskProgress wakeup_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  a_store(&WakeupGlobals.total, 0);
+  a_store(&WakeupGlobals.worst, 0);
+  a_store(&WakeupGlobals.done, 0);
+  WakeupGlobals.wakeups = task_stats().wakeups;
+
+  BenchGlobals.op_count = WAKEUP_ROUNDS;
+  BenchGlobals.begin = asm_rdtsc();
+  assert(thread_spawn(wakeup_thread, NULL));
+  return Done;
+}
+
+static void placement_finished(void) {
+  if (a_add(&BenchGlobals.running, -1) != 1) return;
+
+  s64 fewest = PLACED_TASKS, most = 0;
+  FOR_PTR(PaddedCounters, task_worker_count()) {
+    const s64 count = a_load_rlx(&it->value);
+    fewest = min(fewest, count);
+    most = max(most, count);
+  }
+
+  log_fmt("bench placement: each worker ran %f to %f of %f spread tasks", fewest, most,
+          PLACED_TASKS);
+  log_fmt("bench placement: %f of %f tasks ran on the worker they were sent to",
+          a_load(&PlacementGlobals.on_target), PLACED_TASKS);
+  bench_finished("placement");
+}
+
+static TaskProgress spread_task(void *data, s64 size) {
+  (void)data, (void)size;
+
+  a_add_rlx(&PaddedCounters[cpu_index()].value, 1);
+  placement_finished();
+  return Done;
+}
+
+static TaskProgress targeted_task(void *data, s64 size) {
+  (void)size;
+
+  if ((s64)data == cpu_index()) a_add(&PlacementGlobals.on_target, 1);
+  placement_finished();
+  return Done;
+}
+
+// Tasks spread out with power-of-two choices, which should come out roughly
+// even, and tasks sent to each worker in turn, which should mostly stay there
+static TaskProgress placement_begin(void *data, s64 size) {
+  (void)data, (void)size;
+
+  const s64 workers = task_worker_count();
+  FOR_PTR(PaddedCounters, workers) {
+    a_store(&it->value, 0);
+  }
+  a_store(&PlacementGlobals.on_target, 0);
+
+  BenchGlobals.op_count = 2 * PLACED_TASKS;
+  a_store(&BenchGlobals.running, 2 * PLACED_TASKS);
+  BenchGlobals.begin = asm_rdtsc();
+
+  TaskData batch[FANOUT_BATCH];
+  FOR_PTR(batch, FANOUT_BATCH) {
+    *it = (TaskData){.code = spread_task, .placement = PlaceSpread};
+  }
+
+  REPEAT(PLACED_TASKS / FANOUT_BATCH) {
+    assert(add_tasks(batch, FANOUT_BATCH));
+  }
+
+  RANGE(S64(0), S64(PLACED_TASKS)) {
+    const u16 worker = U16(it % workers);
+    const TaskData task = {
+        .code = targeted_task, .data = (void *)S64(worker), .placement = PlaceOnWorker,
+        .worker = worker};
+    assert(add_tasks(&task, 1));
+  }
+
+  return Done;
+}
+
+static s64 payload_size(TaskPayload kind) {
+  switch (kind) {
+  case PayloadExternal:
+    return 0;
+  case PayloadInline:
+    return S64(sizeof(InlinePayload));
+  case PayloadPooled:
+    return PAYLOAD_POOLED_SIZE;
+  case PayloadPages:
+    return PAYLOAD_PAGES_SIZE;
+  }
+
+  panic("bad payload kind %f", kind);
+}
+
+static void fill_payload(u8 *bytes, s64 size, s64 seed) {
+  memcpy(bytes, &seed, S64(sizeof(seed)));
+  RANGE(S64(sizeof(seed)), size) {
+    bytes[it] = U8(seed + it);
+  }
+}
+
+static bool payload_intact(const u8 *bytes, s64 size, s64 seed) {
+  RANGE(S64(sizeof(seed)), size) {
+    if (bytes[it] != U8(seed + it)) return false;
+  }
+
+  return true;
+}
+
+// Checks its payload, and every so often blocks once first, so that payloads
+// have to survive being parked. The tasks run on whichever worker they were
+// spread to, so pooled payloads mostly get freed away from the pool they came
+// from.
+static TaskProgress payload_task(void *data, s64 size) {
+  const TaskPayload kind = PayloadGlobals.kind;
+
+  s64 seed = (s64)data;
+  if (kind != PayloadExternal) {
+    memcpy(&seed, data, S64(sizeof(seed)));
+    if (size != payload_size(kind) || !payload_intact(data, size, seed))
+      a_add(&PayloadGlobals.corrupt, 1);
+  }
+
+  if (seed % PAYLOAD_BLOCK_EVERY == 0 && !task_signal_is_set(&PayloadGlobals.signal)) {
+    if (a_add(&PayloadGlobals.blocked, 1) == PAYLOAD_TASKS / PAYLOAD_BLOCK_EVERY - 1)
+      task_signal_set(&PayloadGlobals.signal);
+    return task_block_on(&PayloadGlobals.signal);
+  }
+
+  if (a_add(&BenchGlobals.running, -1) != 1) return Done;
+
+  log_fmt("bench payload: %f of %f %f-byte payloads were corrupted",
+          a_load(&PayloadGlobals.corrupt), PAYLOAD_TASKS, payload_size(kind));
+  switch (kind) {
+  case PayloadExternal:
+    bench_finished("payload (none)");
+    break;
+  case PayloadInline:
+    bench_finished("payload (inline)");
+    break;
+  case PayloadPooled:
+    bench_finished("payload (pooled)");
+    break;
+  case PayloadPages:
+    bench_finished("payload (pages)");
+    break;
+  }
+
+  return Done;
+}
+
+// The same tasks with each kind of payload. Without one, the task is as cheap as
+// it gets, which is what the rest cost on top of.
+static void payload_begin(TaskPayload kind) {
+  PayloadGlobals.kind = kind;
+  task_signal_reset(&PayloadGlobals.signal);
+  a_store(&PayloadGlobals.blocked, 0);
+  a_store(&PayloadGlobals.corrupt, 0);
+
+  const s64 size = payload_size(kind);
+  if (kind == PayloadPooled || kind == PayloadPages) {
+    // A copy that never gets submitted has to be given back by hand
+    TaskData unused = {.code = payload_task};
+    fill_payload(PayloadGlobals.scratch, size, -1);
+    assert(TaskData__copy_in(&unused, PayloadGlobals.scratch, size));
+    assert(unused.payload == kind, "a %f-byte payload went in the wrong place", size);
+    TaskData__release(&unused);
+  }
+
+  BenchGlobals.op_count = PAYLOAD_TASKS;
+  a_store(&BenchGlobals.running, PAYLOAD_TASKS);
+  BenchGlobals.begin = asm_rdtsc();
+
+  RANGE(S64(0), S64(PAYLOAD_TASKS)) {
+    switch (kind) {
+    case PayloadExternal: {
+      const TaskData task = {.code = payload_task, .data = (void *)it, .placement = PlaceSpread};
+      assert(add_tasks(&task, 1));
+      break;
+    }
+
+    case PayloadInline: {
+      InlinePayload payload;
+      fill_payload((u8 *)&payload, S64(sizeof(payload)), it);
+      assert(add_task(payload_task, payload));
+      break;
+    }
+
+    case PayloadPooled:
+    case PayloadPages: {
+      fill_payload(PayloadGlobals.scratch, size, it);
+      const TaskData task = {.code = payload_task, .placement = PlaceSpread};
+      assert(add_task_copy(task, PayloadGlobals.scratch, size));
+      break;
+    }
+    }
+  }
+}
+
+static TaskProgress external_payload_begin(void *data, s64 size) {
+  (void)data, (void)size;
+  payload_begin(PayloadExternal);
+  return Done;
+}
+
+static TaskProgress inline_payload_begin(void *data, s64 size) {
+  (void)data, (void)size;
+  payload_begin(PayloadInline);
+  return Done;
+}
+
+static TaskProgress pooled_payload_begin(void *data, s64 size) {
+  (void)data, (void)size;
+  payload_begin(PayloadPooled);
+  return Done;
+}
+
+static TaskProgress pages_payload_begin(void *data, s64 size) {
+  (void)data, (void)size;
+  payload_begin(PayloadPages);
+  return Done;
+}
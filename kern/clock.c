@@ -0,0 +1,51 @@
+#include "clock.h"
+#include "asm.h"
+#include "init.h"
+#include <basics.h>
+#include <macros.h>
+
+// https://wiki.osdev.org/Programmable_Interval_Timer
+#define PIT_HZ         1193182
+#define PIT_CHANNEL_2  0x42
+#define PIT_COMMAND    0x43
+#define PIT_GATE       0x61
+#define PIT_GATE_ON    U8(1)
+#define PIT_SPEAKER    U8(2)
+#define PIT_OUT_2      U8(0x20)
+#define CALIBRATION_MS 10
+
+static u64 TscPerMs;
+
+// Time a one-shot countdown on PIT channel 2, which is wired to a gate we can
+// poll instead of to an interrupt.
+void clock__init(void) {
+  const u16 count = PIT_HZ * CALIBRATION_MS / 1000;
+
+  const u8 gate = U8(in8(PIT_GATE) & ~PIT_SPEAKER);
+  out8(PIT_GATE, U8(gate & ~PIT_GATE_ON));
+
+  // channel 2, low byte then high byte, mode 0 (interrupt on terminal count)
+  out8(PIT_COMMAND, 0xb0);
+  out8(PIT_CHANNEL_2, U8(count));
+  out8(PIT_CHANNEL_2, U8(count >> 8));
+
+  out8(PIT_GATE, gate | PIT_GATE_ON);
+  const u64 begin = asm_rdtsc();
+  while (!(in8(PIT_GATE) & PIT_OUT_2))
+    pause();
+  const u64 end = asm_rdtsc();
+
+  out8(PIT_GATE, U8(gate & ~PIT_GATE_ON));
+
+  TscPerMs = max((end - begin) / CALIBRATION_MS, 1);
+  log_fmt("clock INIT_COMPLETE (TSC runs at %f kHz)", TscPerMs);
+}
+
+u64 tsc_per_ms(void) {
+  return TscPerMs;
+}
+
+u64 tsc_to_ns(u64 ticks) {
+  // split up to avoid overflowing for large tick counts
+  return ticks / TscPerMs * 1000000 + ticks % TscPerMs * 1000000 / TscPerMs;
+}
@@ -0,0 +1,34 @@
+#include "cpu.h"
+#include "asm.h"
+#include <basics.h>
+#include <macros.h>
+#include <sync.h>
+
+#define IA32_GS_BASE 0xC0000101
+
+static Cpu Cpus[CPU_MAX];
+static _Atomic s64 CpuCount;
+
+// NOTE: Nothing runs in ring 3 yet, so GS only ever holds the kernel's base and
+// there's no need for `swapgs` on interrupt entry. That changes once there's
+// userspace.
+void cpu__init_core(void) {
+  const s64 index = a_add(&CpuCount, 1);
+  assert(index < CPU_MAX);
+
+  Cpu *cpu = &Cpus[index];
+  cpu->self = cpu;
+  cpu->index = U16(index);
+  cpu->core_id = core_id();
+
+  cpuSetMSR(IA32_GS_BASE, U64(cpu));
+}
+
+s64 cpu_count(void) {
+  return a_load(&CpuCount);
+}
+
+Cpu *cpu_of(s64 index) {
+  assert(index >= 0 && index < cpu_count());
+  return &Cpus[index];
+}
@@ -1,3 +1,4 @@
+#include "bootboot.h"
 #include "init.h"
 #include "memory.h"
 #include <basics.h>
@@ -22,10 +23,11 @@ typedef struct {
   u16 size;
 } GdtInfo;
 
-// TODO make this actualy work with more than one cpu
+// One code segment, then a TSS (which takes two entries) for every core
 typedef struct {
   u16 index;
-  u64 table[8];
+  u16 capacity;
+  u64 table[];
 } Gdt;
 
 #define GDT__ACCESSED     (U64(1) << 40)
@@ -52,33 +54,59 @@ typedef struct {
 _Static_assert(GDT__KERNEL_CODE == 0x00af9b000000ffffULL, "GDT__KERNEL_CODE has incorrect value");
 _Static_assert(GDT__USER_CODE == 0x00affb000000ffffULL, "GDT__USER_CODE has incorrect value");
 
-static void Gdt__init(Gdt *gdt);
+static struct {
+  Gdt *gdt;
+  Tss *tss_list;
+  u16 code_segment;
+} GdtGlobals;
+
+static void Gdt__init(Gdt *gdt, u16 capacity);
 static u16 Gdt__add_entry(Gdt *gdt, u64 entry);
 static void Gdt__add_tss(Gdt *gdt, const Tss *tss, s64 core_idx);
 static inline void load_gdt(Gdt *base, u16 selector);
 static GdtInfo current_gdt(void);
 
 void descriptor__init() {
-  Gdt *gdt = Bump__bump(&InitAlloc, Gdt);
+  const s64 core_count = bb.numcores;
+  const u16 capacity = U16(2 + core_count * 2);
+
+  Gdt *gdt = zeroed_pages(align_up(sizeof(Gdt) + capacity * sizeof(u64), _4KB) / _4KB);
   assert(gdt);
-  Gdt__init(gdt);
+  Gdt__init(gdt, capacity);
 
-  Tss *tss = Bump__bump(&InitAlloc, Tss);
-  assert(tss);
+  Tss *tss_list = zeroed_pages(align_up(core_count * sizeof(Tss), _4KB) / _4KB);
+  assert(tss_list);
+
+  GdtGlobals.code_segment = Gdt__add_entry(gdt, GDT__KERNEL_CODE);
 
   // TODO make this safer
   //      - Albert Liu, Nov 18, 2021 Thu 23:04 EST
-  void *new_stack = zeroed_pages(2);
-  tss->interrupt_stack_table[0] = U64(new_stack) + 2 * _4KB;
+  RANGE(S64(0), core_count, core) {
+    void *new_stack = zeroed_pages(2);
+    assert(new_stack);
+
+    tss_list[core].interrupt_stack_table[0] = U64(new_stack) + 2 * _4KB;
+    Gdt__add_tss(gdt, &tss_list[core], core);
+  }
 
-  u16 segment = Gdt__add_entry(gdt, GDT__KERNEL_CODE);
-  Gdt__add_tss(gdt, tss, 0);
+  GdtGlobals.gdt = gdt;
+  GdtGlobals.tss_list = tss_list;
 
-  load_gdt(gdt, segment);
+  // The IDT is built on this core from whatever CS is loaded, so it has to be
+  // the kernel's before `interrupts__init`. Each core loads it again, with its
+  // TSS, in `descriptor__init_core`.
+  load_gdt(gdt, GdtGlobals.code_segment);
 
   log_fmt("global descriptor table INIT_COMPLETE");
 }
 
+void descriptor__init_core(s64 core_idx) {
+  load_gdt(GdtGlobals.gdt, GdtGlobals.code_segment);
+
+  u16 tss = tss_segment(core_idx);
+  asm volatile("ltr %0" : : "r"(tss));
+}
+
 u16 tss_segment(s64 core_idx) {
   u16 tss_idx = (U16(core_idx) * 2) + 2;
   return U16(tss_idx << 3);
@@ -122,14 +150,15 @@ exit:
   return;
 }
 
-static void Gdt__init(Gdt *gdt) {
+static void Gdt__init(Gdt *gdt, u16 capacity) {
   gdt->table[0] = 0;
   gdt->index = 1;
+  gdt->capacity = capacity;
 }
 
 static u16 Gdt__add_entry(Gdt *gdt, u64 entry) {
   u16 index = gdt->index;
-  assert(index < 8);
+  assert(index < gdt->capacity);
 
   gdt->table[index] = entry;
   gdt->index = index + 1;
@@ -156,7 +185,7 @@ static void Gdt__add_tss(Gdt *gdt, const Tss *tss, s64 core_idx) {
   high |= (addr & BYTES_32_64) >> 32;
 
   const u16 index = gdt->index;
-  assert(index + 1 < 8);
+  assert(index + 1 < gdt->capacity);
 
   gdt->table[index] = low;
   gdt->table[index + 1] = high;
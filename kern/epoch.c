@@ -0,0 +1,152 @@
+#include "epoch.h"
+#include "cpu.h"
+#include "memory.h"
+#include <basics.h>
+#include <macros.h>
+#include <sync.h>
+
+typedef struct {
+  void *data;
+  s64 count;
+} Retired;
+
+// A page worth of retired allocations, all safe to free once the global epoch
+// reaches `epoch + 2`
+typedef struct RetireBatch {
+  struct RetireBatch *next;
+  u64 epoch;
+  s64 count;
+  Retired items[];
+} RetireBatch;
+
+#define BATCH_ITEM_COUNT S64((_4KB - sizeof(RetireBatch)) / sizeof(Retired))
+
+// `epoch` is the global epoch this core saw at its last quiescent state, or 0
+// if it isn't taking part. Everything else is only touched by its own core.
+typedef struct {
+  CACHE_ALIGNED _Atomic u64 epoch;
+
+  // Filled by `epoch_retire`; full batches move to the sealed list, which is
+  // in epoch order
+  CACHE_ALIGNED RetireBatch *open;
+  RetireBatch *sealed_head;
+  RetireBatch *sealed_tail;
+
+  _Atomic s64 retired_pages;
+  _Atomic s64 freed_pages;
+} EpochCore;
+
+static struct {
+  // Starts at 1, so that 0 can mean "not registered"
+  CACHE_ALIGNED _Atomic u64 epoch;
+  EpochCore cores[CPU_MAX];
+} EpochGlobals = {.epoch = 1};
+
+// Why two epochs: a core could announce epoch E, then pick up a reference, and
+// then the memory gets unlinked and retired in E. The global epoch can move to
+// E + 1 with that reference still live, but moving to E + 2 takes an
+// announcement from that core in E + 1, which comes after it's done.
+static bool epoch_safe(u64 retired, u64 global) {
+  return retired + 2 <= global;
+}
+
+static void free_batch_items(EpochCore *core, RetireBatch *batch) {
+  s64 freed = 0;
+  FOR_PTR(batch->items, batch->count) {
+    release_pages(it->data, it->count);
+    freed += it->count;
+  }
+
+  batch->count = 0;
+  a_add_rlx(&core->freed_pages, freed);
+}
+
+// Move the global epoch forward if every registered core has seen it
+static void try_advance(u64 global) {
+  RANGE(S64(0), cpu_count()) {
+    const u64 seen = a_load_acq(&EpochGlobals.cores[it].epoch);
+    if (seen && seen != global) return;
+  }
+
+  a_cxstrong(&EpochGlobals.epoch, &global, global + 1);
+}
+
+void epoch__init_core(void) {
+  EpochCore *core = &EpochGlobals.cores[cpu_index()];
+  core->open = zeroed_pages(1);
+  assert(core->open);
+
+  a_store(&core->epoch, a_load(&EpochGlobals.epoch));
+}
+
+void epoch_quiescent(void) {
+  EpochCore *core = &EpochGlobals.cores[cpu_index()];
+  const u64 global = a_load(&EpochGlobals.epoch);
+
+  // Releases this core's earlier reads to whoever advances the epoch. Idle
+  // workers come through here constantly, so skip the write if nothing changed.
+  if (a_load_rlx(&core->epoch) != global) a_store_rel(&core->epoch, global);
+
+  // Nobody needs the epoch to move unless they have something to free
+  if (core->sealed_head || core->open->count) try_advance(global);
+}
+
+void epoch_reclaim(void) {
+  EpochCore *core = &EpochGlobals.cores[cpu_index()];
+  if (!core->sealed_head && !core->open->count) return;
+
+  const u64 global = a_load(&EpochGlobals.epoch);
+  while (core->sealed_head && epoch_safe(core->sealed_head->epoch, global)) {
+    RetireBatch *batch = core->sealed_head;
+    core->sealed_head = batch->next;
+    if (!core->sealed_head) core->sealed_tail = NULL;
+
+    free_batch_items(core, batch);
+    release_pages(batch, 1);
+    a_add_rlx(&core->freed_pages, 1);
+  }
+
+  if (core->open->count && epoch_safe(core->open->epoch, global))
+    free_batch_items(core, core->open);
+}
+
+void epoch_retire(void *data, s64 count) {
+  // The batches are only touched by the core they belong to
+  preempt_disable();
+  EpochCore *core = &EpochGlobals.cores[cpu_index()];
+  assert(a_load_rlx(&core->epoch), "retiring memory on a core that isn't registered");
+
+  RetireBatch *batch = core->open;
+  if (batch->count == BATCH_ITEM_COUNT) {
+    RetireBatch *fresh = raw_pages(1);
+    assert(fresh, "out of memory for retired pages");
+    *fresh = (RetireBatch){0};
+
+    if (core->sealed_tail) core->sealed_tail->next = batch;
+    else
+      core->sealed_head = batch;
+    core->sealed_tail = batch;
+
+    core->open = batch = fresh;
+
+    // The sealed batch's page gets freed along with its items
+    a_add_rlx(&core->retired_pages, 1);
+  }
+
+  // Whatever's in the batch was retired in this epoch or earlier, so the batch
+  // as a whole is safe once this epoch is
+  batch->epoch = a_load(&EpochGlobals.epoch);
+  batch->items[batch->count++] = (Retired){.data = data, .count = count};
+  a_add_rlx(&core->retired_pages, count);
+  preempt_enable();
+}
+
+EpochStats epoch_stats(void) {
+  EpochStats stats = {.epoch = S64(a_load(&EpochGlobals.epoch))};
+  FOR_PTR(EpochGlobals.cores, cpu_count()) {
+    stats.retired_pages += a_load_rlx(&it->retired_pages);
+    stats.freed_pages += a_load_rlx(&it->freed_pages);
+  }
+
+  return stats;
+}
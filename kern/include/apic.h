@@ -0,0 +1,17 @@
+#pragma once
+#include <types.h>
+
+// Local APIC id of the current core. Matches `core_id()`, `Cpu.core_id` and
+// `bb.bspid`.
+u16 apic_id(void);
+
+// Send interrupt `vector` to the core with local APIC id `target`
+void apic_send_ipi(u16 target, u8 vector);
+
+// Signal end-of-interrupt to the local APIC. Must be called at the end of every
+// APIC-delivered interrupt handler, except the spurious one.
+void apic_eoi(void);
+
+// Fire `vector` on the current core every `period_us` microseconds. The timer
+// is calibrated against the TSC during `apic__init`.
+void apic_timer_start(u8 vector, u64 period_us);
@@ -52,20 +52,82 @@ typedef struct {
 
 #define CPUID_EDX_APIC    (U64(1) << 9)
 #define CPUID_EDX_PDPE1GB (U64(1) << 26)
+#define CPUID_ECX_PCID    (U64(1) << 17)
+#define CPUID_ECX_MONITOR (U64(1) << 3)
 static inline cpuid_result asm_cpuid(u32 code) {
   cpuid_result result;
   asm("cpuid" : "=a"(result.eax), "=b"(result.ebx), "=c"(result.ecx), "=d"(result.edx) : "0"(code));
   return result;
 }
 
+#define CR4_PCIDE (U64(1) << 17)
+
+// Local APIC id, through cpuid. This is slow, especially in a VM; use
+// `this_cpu()->core_id` instead once the core is registered.
 static inline u16 core_id(void) {
   return asm_cpuid(1).ebx >> 24;
 }
 
+static inline u64 asm_rdtsc(void) {
+  u32 lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return (U64(hi) << 32) | lo;
+}
+
 static inline void pause(void) {
   asm volatile("pause");
 }
 
+#define RFLAGS_IF (U64(1) << 9)
+
+static inline void asm_sti(void) {
+  asm volatile("sti" : : : "memory");
+}
+
+static inline void asm_cli(void) {
+  asm volatile("cli" : : : "memory");
+}
+
+// `sti` only takes effect after the next instruction, so an interrupt that was
+// held off by a `cli` before this wakes the `hlt` instead of being taken just
+// before it
+static inline void asm_sti_hlt(void) {
+  asm volatile("sti; hlt" : : : "memory");
+}
+
+// Arm the monitor on the cache line holding `address`; a write to it by any core
+// wakes a following `asm_mwait`
+static inline void asm_monitor(const void *address) {
+  asm volatile("monitor" : : "a"(address), "c"(0), "d"(0) : "memory");
+}
+
+// Sleep until the monitored line is written, or an interrupt arrives
+static inline void asm_mwait(void) {
+  asm volatile("mwait" : : "a"(0), "c"(0) : "memory");
+}
+
+// Disable interrupts, returning the previous value of rflags
+static inline u64 irq_save(void) {
+  u64 flags;
+  asm volatile("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+// Re-enable interrupts if they were enabled when `irq_save` was called
+static inline void irq_restore(u64 flags) {
+  if (flags & RFLAGS_IF) asm_sti();
+}
+
+static inline void invlpg(u64 virt) {
+  asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+// Flush every non-global translation tagged with the current PCID
+static inline void flush_tlb(void) {
+  u64 cr3;
+  asm volatile("movq %%cr3, %0; movq %0, %%cr3" : "=r"(cr3) : : "memory");
+}
+
 static u64 cpuGetMSR(u32 msr) {
   u32 lo, hi;
   asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
@@ -0,0 +1,6 @@
+#pragma once
+#include <types.h>
+
+// Queue up the kernel benchmarks. They run one after another on the task
+// system, and each one logs its results when it finishes.
+void bench__run(void);
@@ -0,0 +1,8 @@
+#pragma once
+#include <types.h>
+
+// TSC ticks per millisecond, measured against the PIT during boot
+u64 tsc_per_ms(void);
+
+// Convert an amount of TSC ticks to nanoseconds
+u64 tsc_to_ns(u64 ticks);
@@ -0,0 +1,55 @@
+#pragma once
+#include <stddef.h>
+#include <sync.h>
+#include <types.h>
+
+// xAPIC ids are 8 bits wide, so there can't be more cores than this
+#define CPU_MAX 256
+
+// Per-core data, reached through the GS segment base. Each core gets a dense
+// index in `[0, cpu_count())` when it registers, and per-core tables in the rest
+// of the kernel are indexed by that instead of by APIC id.
+typedef struct Cpu {
+  struct Cpu *self; // has to be first, see `this_cpu`
+  u16 index;
+  u16 core_id; // local APIC id
+
+  struct WorkerState *worker; // set in `task_begin`
+  struct Thread *thread;      // the kernel thread running here, if any
+
+  // Only touched by this core, and by its own interrupt handlers
+  u32 preempt_count; // locks held; the thread here can't be preempted unless 0
+  u64 ticks;         // timer interrupts taken
+} CACHE_ALIGNED Cpu;
+
+// Register the current core and point its GS base at its `Cpu`. Every core runs
+// this before anything else.
+void cpu__init_core(void);
+
+// Number of cores that have registered so far
+s64 cpu_count(void);
+Cpu *cpu_of(s64 index);
+
+// These are volatile so that they don't get cached across a point where the
+// running code could move to another core.
+static inline Cpu *this_cpu(void) {
+  Cpu *cpu;
+  asm volatile("movq %%gs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+
+static inline u16 cpu_index(void) {
+  u16 index;
+  asm volatile("movw %%gs:%c1, %0" : "=r"(index) : "i"(offsetof(Cpu, index)));
+  return index;
+}
+
+// Each of these is a single instruction, so a thread can't get preempted and
+// moved halfway through, and end up changing another core's count.
+static inline void preempt_disable(void) {
+  asm volatile("incl %%gs:%c0" : : "i"(offsetof(Cpu, preempt_count)) : "memory");
+}
+
+static inline void preempt_enable(void) {
+  asm volatile("decl %%gs:%c0" : : "i"(offsetof(Cpu, preempt_count)) : "memory");
+}
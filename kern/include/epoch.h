@@ -0,0 +1,35 @@
+#pragma once
+#include <types.h>
+
+// Quiescent-state-based reclamation, for memory that lock-free readers on
+// other cores might still be looking at. Instead of being freed, it's retired;
+// once every registered core has passed through a quiescent state (a point
+// where it holds no references into shared lock-free structures), it goes back
+// to the page allocator.
+//
+// The workers' quiescent state is the top of the `task_main` loop, so a core
+// that's stuck in a long task holds up reclamation for everyone.
+
+// Start taking part; the core has to hit quiescent states from now on
+void epoch__init_core(void);
+
+// Announce that this core holds no references, and move the epoch forward if
+// this core is waiting on it
+void epoch_quiescent(void);
+
+// Free whatever memory this core retired that's now safe to free. It's kept
+// apart from `epoch_quiescent` so that workers can put it off while there's
+// more urgent work.
+void epoch_reclaim(void);
+
+// Free `count` pages starting at `data` once no core could still be reading
+// them. Only registered cores can retire memory.
+void epoch_retire(void *data, s64 count);
+
+typedef struct {
+  s64 epoch;
+  s64 retired_pages;
+  s64 freed_pages;
+} EpochStats;
+
+EpochStats epoch_stats(void);
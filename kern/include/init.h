@@ -5,7 +5,23 @@ extern Bump InitAlloc;
 
 void memory__init(void);
 void descriptor__init(void);
+void interrupts__init(void);
+void apic__init(void);
+void tlb__init(void);
+void clock__init(void);
 void tasks__init(void);
+void threads__init(void);
+void timers__init(void);
+
+// Run by every core except the BSP, once the BSP's `memory__init` has built the
+// kernel's page table
+void memory__init_core(void);
+
+// Per-core setup, run by every core in `task_begin`
+void descriptor__init_core(s64 core_idx);
+void apic__init_core(void);
+void threads__init_core(void);
+void tlb__init_core(void);
 
 // Defined in descriptor_tables.c
 u16 tss_segment(s64 core_idx);
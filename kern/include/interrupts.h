@@ -12,4 +12,20 @@ typedef struct {
 #define HANDLER       __attribute__((interrupt)) void
 #define NORET_HANDLER __attribute__((noreturn, interrupt)) void
 
+// Interrupt vectors. The legacy PIC is remapped out of the way of the CPU
+// exceptions and then masked; its spurious interrupts still need somewhere to go.
+#define INT_APIC_TIMER      U8(0xd0)
+#define INT_TASK_WAKEUP     U8(0xd1)
+#define INT_PIC_BASE        U8(0xe0)
+#define INT_TLB_SHOOTDOWN   U8(0xf0)
+#define INT_APIC_SPURIOUS   U8(0xff)
+
+typedef HANDLER (*InterruptHandler)(ExceptionStackFrame *);
+
+// Load the kernel IDT on the current core. The IDT is shared by every core, and
+// is built by `interrupts__init`.
 void load_idt(void);
+
+// Route `vector` to `handler` on every core. Handlers run on the interrupted
+// stack with interrupts disabled.
+void set_interrupt_handler(u8 vector, InterruptHandler handler);
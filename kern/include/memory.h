@@ -3,6 +3,14 @@
 
 #define MEMORY__KERNEL_SPACE_BEGIN ((u64)0xffff800000000000ull)
 
+// Device memory is mapped into its own window, so that it can be uncached even
+// when it overlaps the direct map of physical memory.
+#define MEMORY__MMIO_BEGIN ((u64)0xffffff0000000000ull)
+
+// Kernel thread stacks get their own window too, so that each one can have an
+// unmapped guard page under it.
+#define MEMORY__THREAD_STACKS_BEGIN ((u64)0xfffffe0000000000ull)
+
 // get physical address from kernel address
 u64 physical_address(const void *ptr);
 
@@ -25,6 +33,10 @@ void *zeroed_pages(s64 count);
 // Release contiguous pages starting at data
 void release_pages(void *data, s64 count);
 
+// Map `count` pages of device memory starting at physical address `address`
+// into the MMIO window, uncached. Returns NULL on failure.
+void *map_mmio(u64 address, s64 count);
+
 void unsafe_mark_memory_usability(const void *data, s64 count, bool usable);
 
 // Check that the heap is in a valid state
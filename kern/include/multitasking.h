@@ -1,26 +1,157 @@
 #pragma once
+#include <magic.h>
 #include <types.h>
 
+// Tasks are resumable: one that can't make progress returns `Blocked` (through
+// `task_block_on`), and gets run again from the top, with the same data, once
+// whatever it's waiting on happens. Any state it needs to pick up where it left
+// off goes in its data.
 typedef enum { Done, Blocked } TaskProgress;
-typedef void (*TaskCode)(void *data, s64 size);
+typedef TaskProgress (*TaskCode)(void *data, s64 size);
+
+// Each worker has a queue per priority. Critical work always runs first;
+// background work (like pre-zeroing pages) runs when there's nothing else, and
+// occasionally ahead of normal work so it can't be starved. Zero is normal.
+typedef enum { PriorityNormal, PriorityCritical, PriorityBackground } TaskPriority;
+#define PRIORITY_COUNT 3
+
+// Which worker's queue a task starts out on. By default it's the submitting
+// worker's, so that the task runs where its data is probably still in cache.
+// `PlaceOnWorker` sends it to `TaskData.worker` instead, and `PlaceSpread` to
+// whichever of two random workers has less queued, counting what's been sent to
+// them. The target queues the task itself the next time it looks for work; it
+// can't be stolen before that, but idle workers can steal it from there. Tasks
+// submitted from outside of a worker always go through the global injector.
+typedef enum { PlaceLocal, PlaceOnWorker, PlaceSpread } TaskPlacement;
+
+// Where a task's data lives. By default, `TaskData.data` points at memory the
+// submitter keeps alive. A copied payload is owned by the task instead: small
+// ones are stored inline in the task itself, and bigger ones out of line, and
+// freed once the task returns Done.
+typedef enum { PayloadExternal, PayloadInline, PayloadPooled, PayloadPages } TaskPayload;
+#define TASK_INLINE_SIZE 48
+
 typedef struct {
   TaskCode code;
-  void *data;
+  void *data; // unused for inline payloads
   s64 data_size;
+
+  // TSC by which the task should have started, or 0 for none. A normal or
+  // background task that's still the oldest on its queue after its deadline
+  // gets run ahead of the rest of its queue.
+  u64 deadline;
+
+  TaskPriority priority;
+  TaskPlacement placement;
+  u16 worker; // for `PlaceOnWorker`
+  TaskPayload payload;
+
+  _Alignas(16) u8 inline_data[TASK_INLINE_SIZE];
 } TaskData;
 
+#define _CHECK_TASK_CODE(fn)                                                                       \
+  _Static_assert(__builtin_types_compatible_p(typeof(fn), TaskProgress(void *, s64)),              \
+                 "task code should have the signature `TaskProgress(void *data, s64 size)`")
+
 #define add_task(...)  PASTE(_add_task, NARG(__VA_ARGS__))(__VA_ARGS__)
-#define _add_task1(fn) (_Static_assert(CMP_TYPE(typeof(fn())), void), _add_task(fn, NULL, 0))
-#define _add_task2(fn, data)                                                                       \
-  (_Static_assert(CMP_TYPE(typeof(fn(data))), void),                                               \
-   (sizeof() > 8) ? _add_task(fn, &(data), sizeof(data)) : _add_task(fn, data, 0))
-#define _add_task3(fn, data_ptr, size)                                                             \
-  (_Static_assert(CMP_TYPE(typeof(fn(data, size))), void), _add_task(fn, data_ptr, size))
+#define _add_task1(fn) _add_task(fn, NULL, 0)
+
+// Copies `value` into the task, which gets a pointer to the copy
+#define _add_task2(fn, value)                                                                      \
+  ({                                                                                               \
+    _CHECK_TASK_CODE(fn);                                                                          \
+    typeof(value) M_value = (value);                                                               \
+    add_task_copy((TaskData){.code = (fn)}, &M_value, S64(sizeof(M_value)));                       \
+  })
+#define _add_task3(fn, data_ptr, size) _add_task(fn, data_ptr, size)
 
-#define _add_task(fn, data, size)                                                                  \
-  add_task_inner((TaskData){.code = (TaskCode)(fn), .data = (void *)(data), .data_size = size})
+#define _add_task(fn, data_ptr, size)                                                              \
+  ({                                                                                               \
+    _CHECK_TASK_CODE(fn);                                                                          \
+    add_task_inner((TaskData){.code = (fn), .data = (void *)(data_ptr), .data_size = (size)});     \
+  })
 
 bool add_task_inner(TaskData data);
 
+// Copy `size` bytes from `bytes` into `task` as its payload, replacing its
+// `data`. Returns false if it didn't fit inline and there wasn't memory for it.
+bool TaskData__copy_in(TaskData *task, const void *bytes, s64 size);
+
+// Free `task`'s payload, if it has one out of line; for tasks that are never
+// going to be submitted after all. Submitting a task hands its payload over to
+// the task system, which frees it even if the submission fails, so a task
+// that's been submitted shouldn't be released.
+void TaskData__release(const TaskData *task);
+
+// Queue `task` with a copy of `size` bytes from `bytes` as its payload, so the
+// caller doesn't need to keep them around
+bool add_task_copy(TaskData task, const void *bytes, s64 size);
+
+// Queue a task behind everything that's already waiting, through the global
+// FIFO instead of this worker's deque
+bool add_task_later(TaskData data);
+
+// Submit a batch of tasks at once; they're published to the queue together,
+// which is much cheaper than submitting them one at a time
+bool add_tasks(const TaskData *items, s64 count);
+
+// Something tasks can wait on. Once it's set, every task waiting on it goes back
+// on the queue of the worker it blocked on, and tasks that block on it later
+// just get re-queued right away, until it's reset. Zero-initialized is unset.
+typedef struct ParkedTask ParkedTask;
+typedef struct {
+  ParkedTask *_Atomic waiters;
+} TaskSignal;
+
+// Park the running task on `signal` once it returns. Use it as
+// `return task_block_on(&signal);`.
+TaskProgress task_block_on(TaskSignal *signal);
+
+// Wake everything waiting on `signal`. Doesn't touch any deques, so it's safe
+// to call from interrupt handlers.
+void task_signal_set(TaskSignal *signal);
+void task_signal_reset(TaskSignal *signal);
+bool task_signal_is_set(TaskSignal *signal);
+
+// Futex-style wait queues, keyed by address. A task waits on an address for as
+// long as the value there is `expected`; whoever changes it wakes some number of
+// the tasks waiting on it. Tasks woken go back on the queue of the worker they
+// blocked on, like with signals.
+//
+// Park the running task once it returns, unless the value at `address` isn't
+// `expected` by then, in which case it's just queued again. Use it as
+// `return task_wait_if(&value, expected);`.
+TaskProgress task_wait_if(const _Atomic u32 *address, u32 expected);
+
+// Wake up to `count` of the tasks waiting on `address`, oldest first, and return
+// how many there were. Change the value before calling this. It's safe to call
+// from interrupt handlers.
+s64 task_wake(const _Atomic u32 *address, s64 count);
+#define WAKE_ALL S64(0x7fffffffffffffff)
+
+typedef struct {
+  s64 deque_growths;
+  s64 overflows;      // tasks sent to the injector because their deque was full
+  s64 remote_submits; // tasks submitted from outside of a worker
+  s64 requeues;       // tasks sent to the back of the line with `add_task_later`
+  s64 injector_count;
+  s64 injector_peak;
+  s64 backpressure_events;
+  s64 parks;      // times a task returned Blocked
+  s64 promotions; // tasks run early because they were past their deadline
+  s64 sleeps;     // times an idle worker went to sleep
+  s64 wakeups;    // times a sleeping worker was woken up for new work
+  s64 sleeping;   // workers asleep right now
+  s64 placed;     // tasks sent to another worker's queue by their placement
+} TaskStats;
+
+TaskStats task_stats(void);
+
+// True when there's a large backlog of tasks in the global injector; producers
+// that can wait should stop submitting until this goes back to false.
+bool task_backpressure(void);
+
+s64 task_worker_count(void);
+
 _Noreturn void task_begin(void);
 _Noreturn void task_main(void);
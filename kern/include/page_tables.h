@@ -36,15 +36,43 @@
 
 typedef struct PageTable4 PageTable4;
 
+typedef struct {
+  s64 hits;   // switches that kept the target's TLB entries
+  s64 misses; // switches that had to recycle a PCID and flush
+} PcidStats;
+
 // Called in memory.c
 void UNSAFE_HACKY_higher_half_init(void);
 
+// Enable PCIDs on the current core, if the CPU supports them. After this,
+// `set_page_table` tags each table with a per-core PCID instead of flushing the
+// whole TLB on every switch.
+void pcid__init_core(void);
+PcidStats pcid_stats(void);
+
+// The table most recently loaded on the core with index `cpu`
+PageTable4 *active_page_table(s64 cpu);
+
+// Drop `p4` from `cpu`'s PCID slots, so that the next switch to it flushes its
+// stale translations. If `p4` is NULL, drops every slot except the one holding
+// `cpu`'s active table.
+void pcid_forget(s64 cpu, PageTable4 *p4);
+
 // Read the value of cr3
 PageTable4 *get_page_table(void);
 void set_page_table(PageTable4 *p4);
 
 void traverse_table(PageTable4 *p4);
 
+// Preallocate every kernel-half entry of `p4`, and use it as the template for
+// `new_page_table`. Called once, on the kernel's own table.
+void set_kernel_table(PageTable4 *p4);
+
+// Create a table with an empty user half, sharing the kernel half with every
+// other table.
+PageTable4 *new_page_table(void);
+
+// Free `p4` and its user half. The kernel half is shared, so it's left alone.
 void destroy_table(PageTable4 *p4);
 void destroy_bootboot_table(PageTable4 *p4);
 
@@ -61,3 +89,12 @@ bool map_region(PageTable4 *p4, u64 virt, const void *kernel, s64 size, u64 flag
 bool map_page(PageTable4 *p4, u64 virt, const void *kernel, u64 flags);
 
 bool map_2MB_page(PageTable4 *p4, u64 virt, const void *kernel, u64 flags);
+
+// Remove the mappings for `count` 4KB pages starting at `virt`. Huge pages that
+// are only partly covered are split first, and intermediate tables that end up
+// empty are freed. Every core sees the change by the time this returns.
+bool unmap_region(PageTable4 *p4, u64 virt, s64 count);
+
+// Replace the flags on the mappings for `count` 4KB pages starting at `virt`,
+// splitting huge pages only where the range doesn't cover them entirely.
+bool protect_region(PageTable4 *p4, u64 virt, s64 count, u64 flags);
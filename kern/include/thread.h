@@ -0,0 +1,64 @@
+#pragma once
+#include "multitasking.h"
+#include <types.h>
+
+// Kernel threads: code with its own stack, for work that's easier to write
+// straight-line than as a task state machine. They run on top of the task
+// system; each time a thread runs, it's a task switching onto the thread's
+// stack, and each time it stops, it switches back and the task returns.
+//
+// Stacks are pooled, and each has an unmapped guard page under it, so an
+// overflow faults instead of running into the next stack.
+//
+// Threads that run for longer than the quantum without stopping get preempted
+// by the timer, and sent to the back of the line, so that they can't hold up
+// the tasks queued behind them for long. A thread that's holding a lock isn't
+// preempted until it lets go.
+typedef struct Thread Thread;
+typedef void (*ThreadCode)(void *data);
+
+// Create a thread and queue it to run. Returns false if there weren't any
+// stacks left.
+bool thread_spawn(ThreadCode code, void *data);
+
+// Only callable from a thread. Let other work run, and come back later.
+void thread_yield(void);
+
+// Only callable from a thread. Sleep until `signal` is set.
+void thread_wait(TaskSignal *signal);
+
+// Only callable from a thread. Sleep until woken through `task_wake`, unless the
+// value at `address` isn't `expected` anymore; see `task_wait_if`.
+void thread_wait_if(const _Atomic u32 *address, u32 expected);
+
+// A mutex for threads that sleeps when it's contended, instead of spinning like
+// the locks in sync.h. Threads holding one can still be preempted, and can wait
+// on things. Zero-initialized is unlocked.
+typedef enum { SleepLockFree, SleepLockHeld, SleepLockContended } SleepLockState;
+typedef struct {
+  _Atomic u32 state;
+} SleepLock;
+
+// Times to try again, with backoff, before going to sleep
+#define SLEEP_LOCK_SPINS 16
+
+// Only callable from a thread
+void SleepLock__lock(SleepLock *lock);
+void SleepLock__unlock(SleepLock *lock);
+
+// How long a thread can run before it gets preempted. This is rounded to a
+// whole number of timer ticks, which are THREAD_TICK_US long.
+#define THREAD_TICK_US    500
+#define THREAD_QUANTUM_US 2000
+void thread_set_quantum_us(u64 quantum);
+
+typedef struct {
+  s64 stacks;      // stacks mapped so far, in use or pooled
+  s64 spawned;     // threads created
+  s64 exited;      // threads that have finished
+  s64 switches;    // switches onto a thread stack
+  s64 preempted;   // switches off of one because the quantum ran out
+  s64 lock_sleeps; // times a thread slept on a contended SleepLock
+} ThreadStats;
+
+ThreadStats thread_stats(void);
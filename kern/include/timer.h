@@ -0,0 +1,54 @@
+#pragma once
+#include "multitasking.h"
+#include <types.h>
+
+// Timers that queue a task once some time has passed, optionally over and over.
+// Each core has its own hierarchical timing wheel, which turns once per APIC
+// timer tick (THREAD_TICK_US), so starting and cancelling a timer are constant
+// time no matter how many are pending. Delays are rounded up to whole ticks.
+//
+// Timers are added to the wheel of the core that starts them, and fire there;
+// the task then goes on that core's queues like any other.
+//
+// A pending one-shot timer keeps the task system running, like a queued task
+// would. Periodic ones don't, so they have to be cancelled by whatever's using
+// them, or they just stop when everything else is done.
+typedef struct TimerWheel TimerWheel;
+typedef struct Timer {
+  struct Timer *next;
+  struct Timer **prev_next; // whatever points at this timer, for cancelling
+  u64 expires;              // in ticks of the wheel it's on
+  u64 period;               // in ticks, or 0 for one-shot timers
+  TaskData task;
+  TimerWheel *_Atomic wheel; // NULL while the timer isn't pending
+  bool pooled;               // allocated by `add_task_after`
+} Timer;
+
+// Queue `task` after `delay_us`, and then every `period_us` after that, unless
+// it's 0. `timer` has to stay around until it fires for the last time, or is
+// cancelled, and can't already be pending. Periodic timers can't be given a
+// task with a copied payload that doesn't fit inline.
+void timer_start(Timer *timer, TaskData task, u64 delay_us, u64 period_us);
+
+// Stop `timer` from firing again. Returns false if it wasn't pending. A task it
+// already queued still runs.
+bool timer_cancel(Timer *timer);
+
+// Queue `task` after `delay_us`, without needing a timer to keep track of.
+// Returns false if there wasn't memory for one.
+bool add_task_after(u64 delay_us, TaskData task);
+
+// Fire whatever's due on this core's wheel. Workers call this between tasks.
+void timers_advance(void);
+
+// One-shot timers that haven't fired yet, across all cores
+s64 timers_pending(void);
+
+typedef struct {
+  s64 started;
+  s64 fired;
+  s64 cancelled;
+  s64 cascaded; // times a timer moved down a level of its wheel
+} TimerStats;
+
+TimerStats timer_stats(void);
@@ -0,0 +1,44 @@
+#pragma once
+#include "page_tables.h"
+#include <types.h>
+
+#define TLB_BATCH_SIZE 8
+
+// Invalidations covering more pages than this flush the whole TLB instead of
+// issuing one `invlpg` per page.
+#define TLB_FLUSH_THRESHOLD 32
+
+typedef struct {
+  u64 begin;
+  s64 count; // in 4KB pages
+} TlbRange;
+
+// Invalidations for a single address space, collected while its tables are
+// being edited and then sent out all at once with `TlbBatch__flush`.
+typedef struct {
+  PageTable4 *p4;
+  bool kernel; // whether any queued address is in the kernel half
+  bool flush_all;
+  s32 count;
+  TlbRange ranges[TLB_BATCH_SIZE];
+} TlbBatch;
+
+typedef struct {
+  s64 ipis_sent;
+  s64 pages_invalidated;
+  s64 full_flushes;
+} TlbStats;
+
+TlbBatch TlbBatch__new(PageTable4 *p4);
+
+// Queue `count` pages starting at `virt` for invalidation. Kernel-half addresses
+// are invalidated on every core, regardless of which address space the batch is
+// for.
+void TlbBatch__add(TlbBatch *batch, u64 virt, s64 count);
+
+// Invalidate everything queued in `batch` on every core that might have cached
+// it, with at most one IPI per core. Returns once all of them are done, so the
+// pages and tables that were unmapped can be reused afterwards.
+void TlbBatch__flush(TlbBatch *batch);
+
+TlbStats tlb_stats(void);
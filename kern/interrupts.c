@@ -85,12 +85,11 @@ static u64 IdtEntry__handler_addr(IdtEntry entry);
 static inline IdtEntry IdtEntry__missing(void);
 static u16 IdtEntry__set_IST_index(u16 opts, u8 idx);
 
-static void cpu_set_apic_base(void *ptr);
-static void *cpu_get_apic_base(void);
-
 static NORET_HANDLER Idt__double_fault(ExceptionStackFrame *frame, u64 error_code);
 
-void load_idt(void) {
+static Idt *KernelIdt;
+
+void interrupts__init(void) {
   Idt *idt = Bump__bump(&InitAlloc, Idt);
   assert(idt);
 
@@ -100,34 +99,36 @@ void load_idt(void) {
   }
 
   IdtEntry__set_handler(&idt->double_fault, Idt__double_fault);
+  KernelIdt = idt;
+
+  log_fmt("interrupt descriptor table INIT_COMPLETE");
+}
+
+void load_idt(void) {
+  assert(KernelIdt);
 
   struct {
     u16 size;
     void *idt;
-  } __attribute__((packed)) IDTR = {.size = sizeof(Idt) - 1, .idt = idt};
+  } __attribute__((packed)) IDTR = {.size = sizeof(Idt) - 1, .idt = KernelIdt};
 
   // let the compiler choose an addressing mode
   asm volatile("lidt %0" : : "m"(IDTR));
 
   // TODO SMM attacks? IDK man
   // OSDev describes how to do this: https://wiki.osdev.org/APIC
-
-  // TODO remap interrupts
-
-  // TODO set up local APIC stuff I guess (first step is serial interrupts)
 }
 
-#define IA32_APIC_BASE_MSR        0x1B
-#define IA32_APIC_BASE_MSR_BSP    0x100 // Processor is a BSP
-#define IA32_APIC_BASE_MSR_ENABLE 0x800
-static void cpu_set_apic_base(void *ptr) {
-  u64 apic = physical_address(ptr);
-  cpuSetMSR(IA32_APIC_BASE_MSR, (apic & 0xffffff000) | IA32_APIC_BASE_MSR_ENABLE);
-}
+void set_interrupt_handler(u8 vector, InterruptHandler handler) {
+  assert(KernelIdt);
+  assert(vector >= 32, "vector %f is reserved for CPU exceptions", vector);
+
+  IdtEntry *entry = &((IdtEntry *)KernelIdt)[vector];
+  IdtEntry__set_handler(entry, handler);
 
-static void *cpu_get_apic_base() {
-  u64 apic = cpuGetMSR(IA32_APIC_BASE_MSR) & 0xffffff000;
-  return kernel_ptr(apic);
+  // Only exceptions get their own stack; interrupts run on whatever stack they
+  // interrupted.
+  entry->options = IdtEntry__set_IST_index(entry->options, 0);
 }
 
 /*
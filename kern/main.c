@@ -1,8 +1,13 @@
 #include "asm.h"
+#include "bench.h"
 #include "bootboot.h"
+#include "cpu.h"
 #include "init.h"
 #include "multitasking.h"
 #include <macros.h>
+#include <sync.h>
+
+static _Atomic bool InitDone;
 
 static void init(void) {
   log("--------------------------------------------------");
@@ -20,8 +25,27 @@ static void init(void) {
 
   descriptor__init();
 
+  interrupts__init();
+
+  // The APIC timer is calibrated against the TSC, so this goes first
+  clock__init();
+
+  apic__init();
+
+  tlb__init();
+
   tasks__init();
 
+  threads__init();
+
+  timers__init();
+
+#ifdef BENCH
+  bench__run();
+#endif
+
+  a_store_rel(&InitDone, true);
+
   return task_begin();
 }
 
@@ -30,13 +54,14 @@ static void init(void) {
  ******************************************/
 void _start(void) {
   /*** NOTE: BOOTBOOT runs _start on all cores in parallel ***/
-  if (core_id() == bb.bspid) init();
+  cpu__init_core();
+  if (this_cpu()->core_id == bb.bspid) init();
 
-  // ensure only one core is running
-  while (true) {
-    asm_hlt();
+  // The other cores wait for the BSP to set everything up, and then join in as
+  // workers
+  memory__init_core();
+  while (!a_load_acq(&InitDone))
     pause();
-  }
 
   return task_begin();
 }
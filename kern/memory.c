@@ -6,9 +6,14 @@
 #include <basics.h>
 #include <bitset.h>
 #include <macros.h>
+#include <sync.h>
 #include <types.h>
 
 #define CLASS_COUNT 12
+
+// BOOTBOOT gives each core this much stack, stacked downwards from the top of
+// the address space
+#define BOOTBOOT_STACK_SIZE 1024
 extern const u8 code_begin;
 extern const u8 code_end;
 extern const u8 bss_end;
@@ -48,6 +53,17 @@ static struct {
 
   // NOTE: The smallest size class is 4kb.
   ClassInfo classes[CLASS_COUNT];
+
+  // Next unused address in the MMIO window
+  u64 next_mmio;
+
+  // Protects everything above
+  _Atomic u8 lock;
+
+  // Set once the kernel's table is ready for the other cores to switch to.
+  // BOOTBOOT's table is only freed after all of them have.
+  PageTable4 *_Atomic kernel_table;
+  _Atomic u16 cores_switched;
 } MemGlobals;
 
 Bump InitAlloc;
@@ -59,6 +75,8 @@ static void *alloc_from_entries(MMap mmap, s64 size, s64 align);
 //    if (exact == true), return NULL buffer.
 //    if (exact == false), return the largest contiguous number of pages that exist
 static Buffer alloc_raw(s64 count, bool exact);
+static Buffer alloc_raw_locked(s64 count, bool exact);
+static void release_pages_locked(void *data, s64 count);
 
 // get physical address from kernel address
 u64 physical_address(const void *ptr) {
@@ -203,17 +221,27 @@ void memory__init() {
   res = copy_mapping(new, old, (u64)&environment, 1, PTE_KERNEL);
   assert(res);
 
-  // Map bootboot kernel stack
-  res = copy_mapping(new, old, 0xFFFFFFFFFFFFF000, 1, PTE_KERNEL);
+  // Map bootboot kernel stacks; every core is still running on one
+  const s64 stack_pages = align_up(bb.numcores * BOOTBOOT_STACK_SIZE, _4KB) / _4KB;
+  res = copy_mapping(new, old, 0 - U64(stack_pages) * _4KB, stack_pages, PTE_KERNEL);
   assert(res);
 
   res = copy_mapping(new, old, (u64)&fb, align_up(bb.fb_size, _4KB) / _4KB, PTE_KERNEL);
   assert(res);
 
+  // Every table created from now on shares the kernel half with this one
+  set_kernel_table(new);
+
   // Make sure BSS data stays up-to-date (because it includes MemGlobals)
   set_page_table(new);
   validate_heap();
 
+  // BOOTBOOT started every core on the same table, so they all need to move
+  // off of it before it's freed.
+  a_store(&MemGlobals.kernel_table, new);
+  while (a_load(&MemGlobals.cores_switched) != bb.numcores - 1)
+    pause();
+
   destroy_bootboot_table(old);
   validate_heap();
 
@@ -221,9 +249,20 @@ void memory__init() {
   // at which time it does not matter whether they are freed.
   InitAlloc = Bump__new(2);
 
+  MemGlobals.next_mmio = MEMORY__MMIO_BEGIN;
+
   log_fmt("memory INIT_COMPLETE");
 }
 
+void memory__init_core(void) {
+  PageTable4 *table;
+  while (!(table = a_load(&MemGlobals.kernel_table)))
+    pause();
+
+  set_page_table(table);
+  a_add(&MemGlobals.cores_switched, 1);
+}
+
 static void *alloc_from_entries(MMap mmap, s64 _size, s64 _align) {
   assert(_size > 0 && _align >= 0);
 
@@ -355,6 +394,16 @@ void *raw_pages(s64 count) {
 }
 
 static Buffer alloc_raw(s64 count, bool exact) {
+  while (!Mutex__try_lock(&MemGlobals.lock))
+    pause();
+
+  Buffer buf = alloc_raw_locked(count, exact);
+
+  Mutex__unlock(&MemGlobals.lock);
+  return buf;
+}
+
+static Buffer alloc_raw_locked(s64 count, bool exact) {
   Buffer buf = (Buffer){.data = NULL, .count = 0};
   if (count <= 0) return buf;
 
@@ -425,6 +474,15 @@ static Buffer alloc_raw(s64 count, bool exact) {
 }
 
 void release_pages(void *data, s64 count) {
+  while (!Mutex__try_lock(&MemGlobals.lock))
+    pause();
+
+  release_pages_locked(data, count);
+
+  Mutex__unlock(&MemGlobals.lock);
+}
+
+static void release_pages_locked(void *data, s64 count) {
   assert(data != NULL);
   const u64 addr = physical_address(data);
   assert(addr == align_down(addr, _4KB));
@@ -460,6 +518,25 @@ void release_pages(void *data, s64 count) {
   BitSet__set_range(MemGlobals.free_pages, begin, end, true);
 }
 
+void *map_mmio(u64 address, s64 count) {
+  assert(is_aligned(address, _4KB));
+  assert(count > 0);
+
+  while (!Mutex__try_lock(&MemGlobals.lock))
+    pause();
+
+  const u64 virt = MemGlobals.next_mmio;
+  MemGlobals.next_mmio += U64(count) * _4KB;
+
+  Mutex__unlock(&MemGlobals.lock);
+
+  const u64 flags = PTE_KERNEL | PTE_NO_CACHE | PTE_WRITE_THROUGH;
+  bool res = map_region(get_page_table(), virt, kernel_ptr(address), count, flags);
+  ensure(res) return NULL;
+
+  return (void *)virt;
+}
+
 void unsafe_mark_memory_usability(const void *data, s64 count, bool usable) {
   assert(data != NULL);
   const u64 addr = physical_address(data);
@@ -467,9 +544,14 @@ void unsafe_mark_memory_usability(const void *data, s64 count, bool usable) {
 
   const s64 begin_page = addr / _4KB, end_page = begin_page + count;
 
+  while (!Mutex__try_lock(&MemGlobals.lock))
+    pause();
+
   const bool any_are_free = BitSet__get_any(MemGlobals.free_pages, begin_page, end_page);
   assert(!any_are_free, "if you're marking memory usability, the marked pages can't be free");
 
   const s64 existing_pages = BitSet__get_count(MemGlobals.usable_pages, begin_page, end_page);
   BitSet__set_range(MemGlobals.usable_pages, begin_page, end_page, usable);
+
+  Mutex__unlock(&MemGlobals.lock);
 }
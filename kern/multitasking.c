@@ -1,198 +1,1395 @@
 #include "multitasking.h"
+#include "apic.h"
 #include "asm.h"
 #include "bootboot.h"
+#include "clock.h"
+#include "cpu.h"
+#include "epoch.h"
 #include "init.h"
 #include "interrupts.h"
 #include "memory.h"
+#include "page_tables.h"
+#include "timer.h"
 #include <basics.h>
 #include <macros.h>
+#include <stddef.h>
 #include <sync.h>
 
-#define Task__Empty   U8(0)
-#define Task__Writing U8(1)
-#define Task__Queued  U8(2)
-#define Task__Reading U8(3)
+// BOOTBOOT only gives each core 1KB of stack, which isn't enough to run tasks on
+#define WORKER_STACK_PAGES 4
 
+// Initial capacity of each worker's deque; they double whenever they fill up,
+// until they hit the max. After that, tasks go to the global injector.
+#define DEQUE_INITIAL_COUNT 256
+#define DEQUE_MAX_COUNT     4096
+
+// Once the injector holds more than this many tasks, producers are told to back
+// off through `task_backpressure`.
+#define INJECTOR_BACKPRESSURE 4096
+
+// Most tasks a thief takes in one steal, or a worker takes from the injector at
+// once. The owner also uses this as its safety margin; see `TaskDeque__pop`.
+#define STEAL_BATCH_MAX 16
+
+// Every this many times a worker looks for a task, it checks the injector before
+// its own deque, so that work sent to the back of the line (like preempted
+// threads) can't be starved by a worker that always has local work.
+#define INJECTOR_FAIRNESS 61
+
+// Every this many times a worker looks for a task, it checks for background
+// work before normal work, so that a steady stream of normal tasks can't starve
+// it completely. Critical work still goes first.
+#define BACKGROUND_EVERY 16
+
+// How many times in a row an idle worker comes up empty before it goes to
+// sleep. Spinning for a bit first keeps things cheap when work comes in bursts.
+#define IDLE_SPINS 256
+
+// Copied payloads that don't fit inline, up to what fits in one of these, come
+// out of per-worker pools. Bigger ones get pages of their own.
+#define PAYLOAD_BLOCK_SIZE 256
+
+// Address-keyed wait queues are hashed into this many buckets
+#define WAIT_BUCKETS 256
+
+// Queue latency histograms have one bucket per power of two TSC ticks
+#define LATENCY_BUCKETS 64
+
+// Tasks are padded out to whole cache lines, two of them now that payloads can
+// be inline, so that the owner pushing and a thief stealing neighboring slots
+// don't fight over a line.
+typedef struct {
+  TaskData data;
+  u64 queued_at; // TSC when it last went on a queue
+} CACHE_ALIGNED Task;
+
+typedef struct {
+  s64 mask; // slot count minus one; the slot count is a power of two
+  Task tasks[];
+} TaskArray;
+
+// Chase-Lev work-stealing deque, as described in "Correct and Efficient
+// Work-Stealing for Weak Memory Models" (Le et al.). The owner pushes and pops
+// at `bottom` without any read-modify-write, and thieves take up to half of the
+// tasks from `top` with a single CAS. The two only race over the last
+// `STEAL_BATCH_MAX` tasks.
+//
+// `top` and `bottom` always increase, and need to be masked before indexing.
+// Thieves write `top` and the owner writes the rest, so they get separate
+// cache lines.
 typedef struct {
-  _Atomic u8 sync_info;
-  s64 id;
+  CACHE_ALIGNED _Atomic s64 top;
+
+  CACHE_ALIGNED _Atomic s64 bottom;
+  TaskArray *_Atomic array;
+  s64 growths;
+} TaskDeque;
+
+typedef enum { Stolen, StealEmpty, StealRetry } StealResult;
+
+// Why tasks went to the injector, for the stats
+typedef enum { FromOverflow, FromRemote, FromRequeue } InjectorSource;
+
+typedef struct TaskChunk {
+  struct TaskChunk *next;
+  s64 read_from;
+  s64 write_to;
+  Task tasks[];
+} TaskChunk;
+
+#define CHUNK_TASK_COUNT S64((_4KB - sizeof(TaskChunk)) / sizeof(Task))
+
+// Global FIFO for tasks that don't have a deque to go on: ones submitted from
+// outside of a worker, and ones that overflowed a full deque. It's a list of
+// page-sized chunks, so it only runs out when the page allocator does.
+typedef struct {
+  CACHE_ALIGNED TicketLock lock;
+  TaskChunk *head;
+  TaskChunk *tail;
+
+  // Stats, written under `lock`. They get their own line and a seqlock, so
+  // reading them doesn't get in the way of whoever holds the lock.
+  CACHE_ALIGNED SeqLock stats_seq;
+  s64 peak;
+  s64 overflows;
+  s64 remote_submits;
+  s64 requeues;
+  s64 backpressure_events;
 
+  // Idle workers poll this, so it gets its own line and they don't slow down
+  // whoever's holding the lock
+  CACHE_ALIGNED _Atomic s64 count;
+} Injector;
+
+// A task that returned Blocked. It's linked into its signal's waiter list, or
+// its wait queue, until it's woken, and then into its home worker's `woken`
+// list.
+struct ParkedTask {
+  struct ParkedTask *next;
+  struct WorkerState *home;
+  struct WorkerState *origin; // whose free list it came from
+  const _Atomic u32 *address; // what it's waiting on, if it's in a wait queue
+  bool placed;                // sent here by `add_tasks`, not woken
   TaskData data;
-} Task;
+};
 
-// Get amount queued using `write_to - read_from`
-// `write_to` and `read_from` need to take mod before indexing
+// Wait queues for every address that hashes to the bucket, in the order their
+// tasks started waiting. The lock is taken with interrupts off, so that
+// handlers can wake tasks.
 typedef struct {
-  Task *tasks;
-  s32 task_count;
-  u16 core_id;
+  CACHE_ALIGNED TicketLock lock;
+  ParkedTask *head;
+  ParkedTask **tail;
+} WaitBucket;
+
+static WaitBucket WaitBuckets[WAIT_BUCKETS];
+
+typedef struct PayloadBlock {
+  struct PayloadBlock *next; // in a free list
+  struct WorkerState *origin;
+  _Alignas(16) u8 bytes[];
+} PayloadBlock;
+
+#define PAYLOAD_BLOCK_CAPACITY S64(PAYLOAD_BLOCK_SIZE - sizeof(PayloadBlock))
+
+// Stored in `TaskSignal.waiters` once the signal is set
+#define SIGNAL_SET ((ParkedTask *)1)
+
+typedef struct WorkerState {
+  TaskDeque deques[PRIORITY_COUNT];
+  u64 rng;
 
-  // void* stack_pointer;
+  void *stack_pointer;
   Task running_task;
+  // Set by `task_block_on` or `task_wait_if` while a task runs
+  TaskSignal *blocked_on;
+  const _Atomic u32 *waiting_on;
+  u32 waiting_for;
 
-  _Atomic s64 read_from; // always-increasing index to read from
-  _Atomic s64 write_to;  // always-increasing index to write to
-} WorkerState;
+  // Only touched by this worker; parked tasks come back here once they've
+  // been re-queued, and payloads once their tasks are done
+  ParkedTask *free_parked;
+  PayloadBlock *free_payloads;
+
+  // Time spent running tasks vs. looking for them, in TSC ticks
+  u64 run_time;
+  u64 idle_time;
+  s64 tasks_run;
+  s64 parks;
+  s64 promotions;
+  s64 sleeps;
+  s64 placed;
+  u32 find_count;
+  u32 idle_rounds;
+
+  // How long tasks run here waited in a queue first, by priority; bucket `i`
+  // counts waits shorter than 2^i TSC ticks
+  s64 latency[PRIORITY_COUNT][LATENCY_BUCKETS];
+
+  // Pushed to by whoever wakes this worker's parked tasks. While `sleeping` is
+  // set, the worker is waiting for a write to this line, or for an interrupt;
+  // whoever clears it is responsible for waking the worker up.
+  CACHE_ALIGNED ParkedTask *_Atomic woken;
+  _Atomic bool sleeping;
+  _Atomic s64 inbound; // placed tasks in `woken`, which don't show up in the deques yet
+
+  // Nodes from `free_parked` that other workers are done with, like the ones
+  // for tasks this worker sent them, and the same for `free_payloads`
+  CACHE_ALIGNED ParkedTask *_Atomic returned;
+  PayloadBlock *_Atomic returned_payloads;
+} CACHE_ALIGNED WorkerState;
 
 static struct {
   WorkerState *workers;
   u16 worker_count;
-  _Atomic u16 init_count;
   _Atomic u16 init_finish_count;
 
-  // This could probably be s32 or something, idk
-  _Atomic s64 next_id;
+  // Tasks that have been submitted but haven't finished yet. Every task
+  // touches this, so it's kept away from everything else.
+  CACHE_ALIGNED _Atomic s64 outstanding;
+  CACHE_ALIGNED _Atomic bool finished;
+
+  Injector injectors[PRIORITY_COUNT];
 
-  // TODO: this can be garbage collected, as long as we make tasks movable.
-  Bump task_data_alloc;
+  // Workers that are asleep, or about to be. Producers check this every time
+  // they queue something, so it's on its own line, and only changes when a
+  // worker goes to sleep or wakes up.
+  CACHE_ALIGNED _Atomic s64 sleeping;
+  _Atomic s64 wakeups;
+  bool use_mwait;
 } TaskGlobals;
 
+static s64 TaskArray__pages(s64 count);
+static TaskArray *TaskArray__new(s64 count);
+static s64 TaskDeque__push(TaskDeque *deque, const TaskData *items, s64 count, u64 queued_at);
+static bool TaskDeque__pop(TaskDeque *deque, Task *out);
+static void TaskDeque__shrink(TaskDeque *deque);
+static StealResult TaskDeque__steal(TaskDeque *deque, Task *out, s64 max, s64 *count);
+static s64 Injector__push(Injector *injector, const TaskData *items, s64 count,
+                          InjectorSource source);
+static s64 Injector__pop(Injector *injector, Task *out, s64 max);
+static bool TaskDeque__take_late(TaskDeque *deque, u64 now, Task *out);
+static HANDLER idle_wakeup(ExceptionStackFrame *frame);
+static void wake_idle_worker(const WorkerState *self);
+static void wake_if_sleeping(WorkerState *worker);
+static void idle_sleep(WorkerState *self);
+static bool find_task(WorkerState *self, Task *out);
+static void park_task(WorkerState *self, const Task *task);
+static void requeue_woken(WorkerState *self);
+static s64 steal_tasks(WorkerState *self, TaskPriority priority, Task *out);
+static s64 random_worker(WorkerState *self);
+static ParkedTask *ParkedTask__alloc(WorkerState *self);
+static void wake_parked(ParkedTask *waiters);
+
 void tasks__init(void) {
-  TaskGlobals.workers = Bump__array(&InitAlloc, WorkerState, bb.numcores);
+  const s64 workers_size = S64(sizeof(WorkerState)) * bb.numcores;
+  TaskGlobals.workers = zeroed_pages(align_up(workers_size, _4KB) / _4KB);
+  assert(TaskGlobals.workers);
   TaskGlobals.worker_count = bb.numcores;
-  TaskGlobals.task_data_alloc = Bump__new(4);
 
-  FOR_PTR(TaskGlobals.workers, TaskGlobals.worker_count) {
-    it->tasks = zeroed_pages(2);
-    it->task_count = 2 * _4KB / sizeof(Task);
+  FOR_PTR(TaskGlobals.workers, TaskGlobals.worker_count, worker) {
+    FOR_PTR(worker->deques, PRIORITY_COUNT, deque) {
+      TaskArray *array = TaskArray__new(DEQUE_INITIAL_COUNT);
+      assert(array);
+      a_init(&deque->array, array);
+    }
+
+    worker->rng = U64(index) + 1;
+
+    u8 *stack_begin = zeroed_pages(WORKER_STACK_PAGES);
+    assert(stack_begin);
+    worker->stack_pointer = stack_begin + _4KB * WORKER_STACK_PAGES;
+  }
+
+  FOR_PTR(WaitBuckets, WAIT_BUCKETS) {
+    it->tail = &it->head;
+  }
+
+  // MWAIT can wait on the worker's own cache line, so waking it is just a
+  // write. Without it, workers HLT and need an IPI.
+  TaskGlobals.use_mwait = asm_cpuid(1).ecx & CPUID_ECX_MONITOR;
+  set_interrupt_handler(INT_TASK_WAKEUP, idle_wakeup);
+
+  log_fmt("tasks INIT_COMPLETE (idle workers %f)", TaskGlobals.use_mwait ? "mwait" : "hlt");
+}
+
+s64 task_worker_count(void) {
+  return TaskGlobals.worker_count;
+}
+
+// The injector peak is the highest any one priority's injector got
+TaskStats task_stats(void) {
+  TaskStats stats = {0};
+  FOR_PTR(TaskGlobals.injectors, PRIORITY_COUNT) {
+    TaskStats level;
+    u64 seq;
+    do {
+      seq = SeqLock__read_begin(&it->stats_seq);
+      level = (TaskStats){
+          .injector_count = a_load_rlx(&it->count),
+          .injector_peak = it->peak,
+          .overflows = it->overflows,
+          .remote_submits = it->remote_submits,
+          .requeues = it->requeues,
+          .backpressure_events = it->backpressure_events,
+      };
+    } while (SeqLock__read_retry(&it->stats_seq, seq));
+
+    stats.injector_count += level.injector_count;
+    stats.injector_peak = max(stats.injector_peak, level.injector_peak);
+    stats.overflows += level.overflows;
+    stats.remote_submits += level.remote_submits;
+    stats.requeues += level.requeues;
+    stats.backpressure_events += level.backpressure_events;
+  }
+
+  FOR_PTR(TaskGlobals.workers, TaskGlobals.worker_count, worker) {
+    FOR_PTR(worker->deques, PRIORITY_COUNT, deque) {
+      stats.deque_growths += deque->growths;
+    }
+
+    stats.parks += worker->parks;
+    stats.promotions += worker->promotions;
+    stats.sleeps += worker->sleeps;
+    stats.placed += worker->placed;
+  }
+
+  stats.sleeping = a_load_rlx(&TaskGlobals.sleeping);
+  stats.wakeups = a_load_rlx(&TaskGlobals.wakeups);
+
+  return stats;
+}
+
+bool task_backpressure(void) {
+  s64 count = 0;
+  FOR_PTR(TaskGlobals.injectors, PRIORITY_COUNT) {
+    count += a_load_rlx(&it->count);
+  }
+
+  return count > INJECTOR_BACKPRESSURE;
+}
+
+// Pushes tasks that all have the same priority, onto `worker`'s deque if there
+// is one, and into the injector if not or if it's full
+static s64 push_tasks(WorkerState *worker, const TaskData *items, s64 count) {
+  const TaskPriority priority = items[0].priority;
+  assert(priority < PRIORITY_COUNT, "bad task priority %f", priority);
+
+  s64 pushed = 0;
+  if (worker) pushed = TaskDeque__push(&worker->deques[priority], items, count, asm_rdtsc());
+  if (pushed < count) {
+    const InjectorSource source = worker ? FromOverflow : FromRemote;
+    pushed += Injector__push(&TaskGlobals.injectors[priority], items + pushed, count - pushed,
+                             source);
+  }
+
+  return pushed;
+}
 
-    // u8* stack_begin = zeroed_pages(2);
-    // it->stack_pointer = stack_begin + _4KB * 2;
+// Rough count of what's queued on `worker`, counting what it's running as one
+// more if it's awake
+static s64 worker_load(WorkerState *worker) {
+  s64 load = !a_load_rlx(&worker->sleeping) + a_load_rlx(&worker->inbound);
+  FOR_PTR(worker->deques, PRIORITY_COUNT) {
+    load += max(a_load_rlx(&it->bottom) - a_load_rlx(&it->top), S64(0));
   }
 
-  log_fmt("tasks INIT_COMPLETE");
+  return load;
 }
 
-static s64 get_worker_index(void);
-static Task dequeue_task(WorkerState *worker);
-static bool enqueue_task(WorkerState *worker, TaskData data);
-static _Noreturn void task_main_inner(WorkerState *self, s64 self_index);
+// Which worker `item` should be queued on, when it's submitted from `self`
+static WorkerState *place_task(WorkerState *self, const TaskData *item) {
+  ensure(self) return NULL;
+
+  switch (item->placement) {
+  case PlaceLocal:
+    return self;
+
+  case PlaceOnWorker:
+    assert(item->worker < TaskGlobals.worker_count, "no worker %f to place a task on",
+           item->worker);
+    return &TaskGlobals.workers[item->worker];
+
+  // Power of two choices: nearly as even as checking every worker, for the
+  // price of looking at two
+  case PlaceSpread: {
+    WorkerState *first = &TaskGlobals.workers[random_worker(self)];
+    WorkerState *second = &TaskGlobals.workers[random_worker(self)];
+    return worker_load(first) <= worker_load(second) ? first : second;
+  }
+  }
+
+  panic("bad task placement %f", item->placement);
+}
+
+// Another worker's deque can only be pushed to by its owner, so the task goes to
+// it like a woken task would, and it queues the task itself. Returns false if
+// there wasn't memory for sending it.
+static bool send_task(WorkerState *self, WorkerState *target, const TaskData *item) {
+  ParkedTask *sent = ParkedTask__alloc(self);
+  ensure(sent) return false;
+
+  *sent = (ParkedTask){.home = target, .origin = self, .placed = true, .data = *item};
+  a_add_rlx(&target->inbound, 1);
+  self->placed++;
+  wake_parked(sent);
+  return true;
+}
+
+// Tasks go on the submitting worker's own deque by default, and other workers
+// steal them from there. PlaceOnWorker and PlaceSpread tasks are sent to the
+// worker they're placed on instead, which queues them on its own deque.
+// Anything submitted from outside of a worker, like during init, goes through
+// the injector, whatever its placement.
+//
+// NOTE: The deques aren't safe to push to from interrupt handlers, since the
+// handler could interrupt its own core's worker halfway through a push or pop.
+bool add_tasks(const TaskData *items, s64 count) {
+  assert(count >= 0);
+
+  // A thread that got preempted and moved halfway through a push would be
+  // pushing to a deque it doesn't own anymore
+  preempt_disable();
+  WorkerState *worker = this_cpu()->worker;
+
+  // Counted before they're visible, so that a worker can't finish them and see
+  // the count hit zero in between. This doesn't need to be ordered by itself;
+  // publishing the tasks releases it.
+  a_add_rlx(&TaskGlobals.outstanding, count);
+
+  // Each run of local tasks with the same priority goes on its queue in one
+  // push; the rest are sent one at a time
+  s64 pushed = 0;
+  while (pushed < count) {
+    const TaskData *first = &items[pushed];
+    WorkerState *target = place_task(worker, first);
+    if (target != worker) {
+      if (!send_task(worker, target, first)) break;
+      pushed++;
+      continue;
+    }
+
+    s64 run = 1;
+    while (pushed + run < count && items[pushed + run].priority == first->priority &&
+           items[pushed + run].placement == PlaceLocal)
+      run++;
+
+    const s64 run_pushed = push_tasks(worker, first, run);
+    pushed += run_pushed;
+    if (run_pushed < run) break;
+  }
+
+  if (pushed > 0) wake_idle_worker(worker);
+  preempt_enable();
+
+  if (pushed == count) return true;
+
+  // The caller is giving up on these, so whatever they owned has to go
+  RANGE(pushed, count) {
+    TaskData__release(&items[it]);
+  }
+
+  a_add_rlx(&TaskGlobals.outstanding, pushed - count);
+  return false;
+}
 
 bool add_task_inner(TaskData data) {
-  FOR_PTR(TaskGlobals.workers, TaskGlobals.worker_count) {
-    if (enqueue_task(it, data)) return true;
+  return add_tasks(&data, 1);
+}
+
+static PayloadBlock *PayloadBlock__alloc(WorkerState *self) {
+  if (!self->free_payloads && a_load_rlx(&self->returned_payloads))
+    self->free_payloads = a_xchg_acq(&self->returned_payloads, NULL);
+
+  if (!self->free_payloads) {
+    u8 *page = raw_pages(1);
+    ensure(page) return NULL;
+
+    RANGE(S64(0), S64(_4KB / PAYLOAD_BLOCK_SIZE)) {
+      PayloadBlock *block = (PayloadBlock *)(page + it * PAYLOAD_BLOCK_SIZE);
+      *block = (PayloadBlock){.next = self->free_payloads, .origin = self};
+      self->free_payloads = block;
+    }
+  }
+
+  PayloadBlock *block = self->free_payloads;
+  self->free_payloads = block->next;
+  return block;
+}
+
+// Blocks go back to the pool they came from, like parked task nodes. `self` is
+// NULL outside of a worker.
+static void PayloadBlock__free(WorkerState *self, PayloadBlock *block) {
+  WorkerState *origin = block->origin;
+  if (origin == self) {
+    block->next = self->free_payloads;
+    self->free_payloads = block;
+    return;
+  }
+
+  PayloadBlock *head = a_load_rlx(&origin->returned_payloads);
+  do {
+    block->next = head;
+  } while (!a_cxweak_rel(&origin->returned_payloads, &head, block));
+}
+
+static s64 payload_pages(const TaskData *task) {
+  return align_up(task->data_size, _4KB) / _4KB;
+}
+
+bool TaskData__copy_in(TaskData *task, const void *bytes, s64 size) {
+  assert(size >= 0);
+  task->data_size = size;
+
+  if (size <= TASK_INLINE_SIZE) {
+    task->payload = PayloadInline;
+    task->data = NULL;
+    memcpy(task->inline_data, bytes, size);
+    return true;
   }
 
+  // The pool is this worker's, so the thread calling this can't be moved to
+  // another core while it's taking from it
+  PayloadBlock *block = NULL;
+  preempt_disable();
+  WorkerState *worker = this_cpu()->worker;
+  if (worker && size <= PAYLOAD_BLOCK_CAPACITY) block = PayloadBlock__alloc(worker);
+  preempt_enable();
+
+  if (block) {
+    task->payload = PayloadPooled;
+    task->data = block->bytes;
+  } else {
+    task->payload = PayloadPages;
+    task->data = raw_pages(payload_pages(task));
+    ensure(task->data) return false;
+  }
+
+  memcpy(task->data, bytes, size);
+  return true;
+}
+
+static void release_payload(WorkerState *self, const TaskData *task) {
+  switch (task->payload) {
+  case PayloadExternal:
+  case PayloadInline:
+    break;
+
+  case PayloadPooled:
+    PayloadBlock__free(self, (PayloadBlock *)((u8 *)task->data - offsetof(PayloadBlock, bytes)));
+    break;
+
+  case PayloadPages:
+    release_pages(task->data, payload_pages(task));
+    break;
+  }
+}
+
+void TaskData__release(const TaskData *task) {
+  preempt_disable();
+  release_payload(this_cpu()->worker, task);
+  preempt_enable();
+}
+
+bool add_task_copy(TaskData task, const void *bytes, s64 size) {
+  ensure(TaskData__copy_in(&task, bytes, size)) return false;
+  return add_task_inner(task);
+}
+
+bool add_task_later(TaskData data) {
+  assert(data.priority < PRIORITY_COUNT, "bad task priority %f", data.priority);
+  Injector *injector = &TaskGlobals.injectors[data.priority];
+
+  a_add_rlx(&TaskGlobals.outstanding, 1);
+  if (Injector__push(injector, &data, 1, FromRequeue) == 1) {
+    wake_idle_worker(this_cpu()->worker);
+    return true;
+  }
+
+  TaskData__release(&data);
+  a_add_rlx(&TaskGlobals.outstanding, -1);
   return false;
 }
+
 // TODO Use https://wiki.osdev.org/APIC (and maybe Phil Opperman's Blog?) to set
 // up the APIC and handle logging through serial interrupts
 _Noreturn void task_begin(void) {
-  u16 index = a_add(&TaskGlobals.init_count, 1);
-  WorkerState *state = &TaskGlobals.workers[index];
-  state->core_id = core_id();
-
-  s64 self_index = get_worker_index();
-  WorkerState *self = &TaskGlobals.workers[self_index];
-
-  // TODO switch kernel stacks?
+  const u16 index = cpu_index();
+  assert(index < TaskGlobals.worker_count);
+  WorkerState *self = &TaskGlobals.workers[index];
 
+  descriptor__init_core(index);
   load_idt();
+  pcid__init_core();
+  apic__init_core();
+  threads__init_core();
+  tlb__init_core();
+  epoch__init_core();
+  asm_sti();
 
-  u16 tss = tss_segment(self_index);
-  asm volatile("ltr %0" : : "r"(tss));
-
-  a_add(&TaskGlobals.init_finish_count, 1);
+  a_add_rel(&TaskGlobals.init_finish_count, 1);
 
   // divide_by_zero();
 
-  // TODO Need to enable multicore stuff first.
   // Wait for all cores to be initialized.
-  // while (a_load(&TaskGlobals.init_finish_count) != TaskGlobals.worker_count)
-  //   pause();
+  while (a_load_acq(&TaskGlobals.init_finish_count) != TaskGlobals.worker_count)
+    pause();
+
+  // From here on, tasks submitted on this core go on its own deque
+  this_cpu()->worker = self;
+
+  // Nothing on the old stack is needed anymore
+  asm volatile("movq %0, %%rsp\n\t"
+               "callq *%1"
+               :
+               : "r"(self->stack_pointer), "r"(task_main)
+               : "memory");
+  __builtin_unreachable();
+}
+
+static void record_latency(WorkerState *self, const Task *task, u64 now) {
+  // A task stolen from another core was stamped with that core's TSC, which
+  // could be a little ahead of this one's
+  const u64 waited = now > task->queued_at ? now - task->queued_at : 0;
+  const s64 bucket = waited ? 64 - __builtin_clzll(waited) : 0;
+  self->latency[task->data.priority][min(bucket, S64(LATENCY_BUCKETS - 1))]++;
+}
+
+// Upper bound on the queue latency of `percent` percent of the tasks counted in
+// `histogram`, in nanoseconds
+static u64 latency_percentile(const s64 *histogram, s64 percent) {
+  s64 total = 0;
+  FOR_PTR(histogram, LATENCY_BUCKETS) {
+    total += *it;
+  }
+
+  const s64 wanted = (total * percent + 99) / 100;
+  s64 seen = 0;
+  FOR_PTR(histogram, LATENCY_BUCKETS) {
+    seen += *it;
+    if (seen >= wanted && seen > 0) return tsc_to_ns(U64(1) << index);
+  }
+
+  return 0;
+}
+
+static _Noreturn void tasks_finished(void) {
+  // Only one core gets to shut down
+  if (a_xchg_rlx(&TaskGlobals.finished, true)) {
+    while (true)
+      asm_hlt();
+  }
+
+  FOR_PTR(TaskGlobals.workers, TaskGlobals.worker_count) {
+    log_fmt("worker %f: ran %f tasks, busy for %fns, idle for %fns", index, it->tasks_run,
+            tsc_to_ns(it->run_time), tsc_to_ns(it->idle_time));
+  }
+
+  static const char *const PriorityNames[PRIORITY_COUNT] = {
+      [PriorityNormal] = "normal",
+      [PriorityCritical] = "critical",
+      [PriorityBackground] = "background",
+  };
+
+  RANGE(S64(0), S64(PRIORITY_COUNT), priority) {
+    s64 histogram[LATENCY_BUCKETS] = {0};
+    FOR_PTR(TaskGlobals.workers, TaskGlobals.worker_count, worker) {
+      RANGE(S64(0), S64(LATENCY_BUCKETS), bucket) {
+        histogram[bucket] += worker->latency[priority][bucket];
+      }
+    }
 
-  task_main();
+    log_fmt("%f tasks: queue latency p50 < %fns, p99 < %fns, max < %fns", PriorityNames[priority],
+            latency_percentile(histogram, 50), latency_percentile(histogram, 99),
+            latency_percentile(histogram, 100));
+  }
+
+  const TaskStats stats = task_stats();
+  log_fmt("tasks: %f deque growths, %f overflowed, %f remote, %f requeued, injector peaked at %f",
+          stats.deque_growths, stats.overflows, stats.remote_submits, stats.requeues,
+          stats.injector_peak);
+  log_fmt("tasks: %f promoted past their deadline", stats.promotions);
+  log_fmt("tasks: idle workers slept %f times, and were woken for work %f times", stats.sleeps,
+          stats.wakeups);
+
+  const EpochStats epochs = epoch_stats();
+  log_fmt("epoch %f: %f pages retired, %f freed", epochs.epoch, epochs.retired_pages,
+          epochs.freed_pages);
+
+  log_fmt("Kernel main end");
+  exit(0);
 }
 
 _Noreturn void task_main(void) {
-  s64 self_index = get_worker_index();
-  WorkerState *self = &TaskGlobals.workers[self_index];
+  WorkerState *self = this_cpu()->worker;
   Task *task = &self->running_task;
+  u64 timestamp = asm_rdtsc();
 
   while (true) {
-    RANGE(0, TaskGlobals.worker_count) {
-      s64 worker_index = (it + self_index) % TaskGlobals.worker_count;
-      *task = dequeue_task(&TaskGlobals.workers[worker_index]);
-      if (task->sync_info != Task__Empty) break(it);
+    // Between tasks, this worker isn't holding on to anything in another
+    // worker's deque
+    epoch_quiescent();
+    timers_advance();
+
+    const bool found = find_task(self, task);
+
+    const u64 found_at = asm_rdtsc();
+    self->idle_time += found_at - timestamp;
+    timestamp = found_at;
+
+    if (!found) {
+      // Nothing's queued, nothing's running that could queue more, and no timer
+      // is going to. Timers hand off to `outstanding` before they stop being
+      // pending, so they're checked first.
+      if (timers_pending() == 0 && a_load_acq(&TaskGlobals.outstanding) == 0) tasks_finished();
+
+      epoch_reclaim();
+      FOR_PTR(self->deques, PRIORITY_COUNT) {
+        TaskDeque__shrink(it);
+      }
+
+      if (++self->idle_rounds < IDLE_SPINS) pause();
+      else
+        idle_sleep(self);
+
+      continue;
     }
 
-    if (task->sync_info == Task__Empty) log_fmt("Found no tasks");
-    else
-      log_fmt("Found a task");
+    self->idle_rounds = 0;
 
-    // TODO run task
+    // Freeing retired memory is background work too, so it waits until there's
+    // no critical task to run
+    if (task->data.priority != PriorityCritical) epoch_reclaim();
 
-    log_fmt("Kernel main end");
-    exit(0);
+    record_latency(self, task, found_at);
 
-    pause();
+    // A blocked task is still outstanding, and keeps its payload; it isn't
+    // finished until it returns Done
+    TaskData *data = &task->data;
+    void *payload = data->payload == PayloadInline ? data->inline_data : data->data;
+    const TaskProgress progress = data->code(payload, data->data_size);
+    if (progress == Blocked) park_task(self, task);
+    else {
+      release_payload(self, data);
+      a_add_rlx(&TaskGlobals.outstanding, -1);
+    }
+
+    timestamp = asm_rdtsc();
+    self->run_time += timestamp - found_at;
+    self->tasks_run++;
   }
 }
 
-static s64 get_worker_index(void) {
-  const u16 id = core_id();
-  FOR_PTR(TaskGlobals.workers, TaskGlobals.worker_count) {
-    if (it->core_id == id) return index;
+// The first task of a batch from the injector or another worker gets run, and
+// the rest go on the local deque, where other workers can steal them again
+static bool take_batch(WorkerState *self, Task *batch, s64 count, Task *out) {
+  if (!count) return false;
+
+  *out = batch[0];
+
+  TaskData rest[STEAL_BATCH_MAX - 1];
+  RANGE(S64(1), count) {
+    rest[it - 1] = batch[it].data;
+  }
+
+  // The deque was just empty, so there's always room. The oldest of the rest
+  // stands in for when they were all queued.
+  TaskDeque *deque = &self->deques[out->data.priority];
+  const u64 queued_at = count > 1 ? batch[1].queued_at : 0;
+  assert(TaskDeque__push(deque, rest, count - 1, queued_at) == count - 1);
+
+  // There's more here than this worker can run at once, so get another one
+  // going to steal some of it. That one does the same, so a burst of work
+  // wakes up as many workers as it needs, one at a time.
+  if (count > 1) wake_idle_worker(self);
+
+  return true;
+}
+
+// In priority order, with background work moved ahead of normal work every
+// BACKGROUND_EVERY calls
+static const TaskPriority ScanOrder[2][PRIORITY_COUNT] = {
+    {PriorityCritical, PriorityNormal, PriorityBackground},
+    {PriorityCritical, PriorityBackground, PriorityNormal},
+};
+
+// Newest local work first, since it's most likely to still be in cache. Each
+// kind of queue is checked from the highest priority down before moving on to
+// the next kind, so a worker with local work never goes looking elsewhere,
+// except for critical work sent through the injector, which is cheap to check.
+// Tasks past their deadline get run ahead of anything that isn't critical.
+static bool find_task(WorkerState *self, Task *out) {
+  if (a_load_rlx(&self->woken)) requeue_woken(self);
+
+  const u32 finds = ++self->find_count;
+  const TaskPriority *order = ScanOrder[finds % BACKGROUND_EVERY == 0];
+  if (finds % INJECTOR_FAIRNESS == 0) {
+    FOR_PTR(order, PRIORITY_COUNT) {
+      if (Injector__pop(&TaskGlobals.injectors[*it], out, 1)) return true;
+    }
+  }
+
+  Task batch[STEAL_BATCH_MAX];
+  if (TaskDeque__pop(&self->deques[PriorityCritical], out)) return true;
+  s64 count = Injector__pop(&TaskGlobals.injectors[PriorityCritical], batch, STEAL_BATCH_MAX);
+  if (take_batch(self, batch, count, out)) return true;
+
+  const u64 now = asm_rdtsc();
+  if (TaskDeque__take_late(&self->deques[PriorityNormal], now, out) ||
+      TaskDeque__take_late(&self->deques[PriorityBackground], now, out)) {
+    self->promotions++;
+    return true;
+  }
+
+  RANGE(S64(1), S64(PRIORITY_COUNT)) {
+    if (TaskDeque__pop(&self->deques[order[it]], out)) return true;
+  }
+
+  RANGE(S64(1), S64(PRIORITY_COUNT)) {
+    count = Injector__pop(&TaskGlobals.injectors[order[it]], batch, STEAL_BATCH_MAX);
+    if (take_batch(self, batch, count, out)) return true;
+  }
+
+  FOR_PTR(order, PRIORITY_COUNT) {
+    if (take_batch(self, batch, steal_tasks(self, *it, batch), out)) return true;
   }
 
-  log_fmt("Unreachable?");
-  exit(1);
+  return false;
 }
 
-static Task dequeue_task(WorkerState *worker) {
-  const s64 write_to = a_load(&worker->write_to);
-  s64 read_from = a_load(&worker->read_from);
-  Task *const tasks = worker->tasks;
-  const s32 task_count = worker->task_count;
+// Put a task that's already counted in `outstanding` back on the queues
+static void requeue(WorkerState *self, const TaskData *data) {
+  if (TaskDeque__push(&self->deques[data->priority], data, 1, asm_rdtsc()) == 1) return;
+
+  assert(Injector__push(&TaskGlobals.injectors[data->priority], data, 1, FromRequeue) == 1,
+         "out of memory for re-queueing a task");
+}
 
-  Task task;
-  LOOP(find_task) {
-    u8 current = Task__Queued;
-    Task *target = &tasks[read_from % task_count];
-    if (a_cxstrong(&target->sync_info, &current, Task__Reading)) {
-      task = *target;
+static ParkedTask *ParkedTask__alloc(WorkerState *self) {
+  if (!self->free_parked && a_load_rlx(&self->returned))
+    self->free_parked = a_xchg_acq(&self->returned, NULL);
 
-      // we have mutual exclusion here, so we just write directly
-      a_store(&target->sync_info, Task__Empty);
+  if (!self->free_parked) {
+    ParkedTask *page = raw_pages(1);
+    ensure(page) return NULL;
 
-      break(find_task);
+    RANGE(S64(0), S64(_4KB / sizeof(ParkedTask))) {
+      page[it].next = self->free_parked;
+      self->free_parked = &page[it];
     }
+  }
+
+  ParkedTask *parked = self->free_parked;
+  self->free_parked = parked->next;
+  return parked;
+}
+
+// Nodes go back to the worker they came from, so that one that sends a lot of
+// tasks to others doesn't keep allocating new ones
+static void ParkedTask__free(WorkerState *self, ParkedTask *parked) {
+  WorkerState *origin = parked->origin;
+  if (origin == self) {
+    parked->next = self->free_parked;
+    self->free_parked = parked;
+    return;
+  }
 
-    while (read_from < write_to) {
-      if (a_cxweak(&worker->read_from, &read_from, read_from + 1)) continue(find_task);
+  ParkedTask *head = a_load_rlx(&origin->returned);
+  do {
+    parked->next = head;
+  } while (!a_cxweak_rel(&origin->returned, &head, parked));
+}
+
+static WaitBucket *wait_bucket(const _Atomic u32 *address) {
+  // Fibonacci hashing; the low bits are always zero, so they're dropped first
+  const u64 hash = (U64(address) >> 2) * 0x9e3779b97f4a7c15;
+  return &WaitBuckets[hash >> (64 - __builtin_ctzll(WAIT_BUCKETS))];
+}
+
+static void wait_queue_park(WorkerState *self, ParkedTask *parked) {
+  WaitBucket *bucket = wait_bucket(parked->address);
+  const u64 flags = irq_save();
+  TicketLock__lock(&bucket->lock);
+
+  // Checked under the lock, so that a waker that changed the value before this
+  // sees the task in the queue, and one that changes it after takes the lock
+  // after it's in there
+  const bool waiting = a_load_rlx(parked->address) == self->waiting_for;
+  if (waiting) {
+    parked->next = NULL;
+    *bucket->tail = parked;
+    bucket->tail = &parked->next;
+  }
+
+  TicketLock__unlock(&bucket->lock);
+  irq_restore(flags);
+
+  if (waiting) return;
+
+  // The value already changed, so there's nothing to wait for
+  requeue(self, &parked->data);
+  ParkedTask__free(self, parked);
+}
+
+static void park_task(WorkerState *self, const Task *task) {
+  TaskSignal *signal = self->blocked_on;
+  const _Atomic u32 *address = self->waiting_on;
+  assert(signal || address, "task returned Blocked without saying what it's waiting on");
+  self->blocked_on = NULL;
+  self->waiting_on = NULL;
+  self->parks++;
+
+  ParkedTask *parked = ParkedTask__alloc(self);
+  assert(parked, "out of memory for parking a task");
+  *parked = (ParkedTask){.home = self, .origin = self, .address = address, .data = task->data};
+  if (address) {
+    wait_queue_park(self, parked);
+    return;
+  }
+
+  // Releases the node to whoever sets the signal, and acquires whatever they
+  // did before setting it if they got there first
+  ParkedTask *head = a_load_acq(&signal->waiters);
+  do {
+    // Set before we got here, so there's nothing to wait for
+    if (head == SIGNAL_SET) {
+      requeue(self, &parked->data);
+      ParkedTask__free(self, parked);
+      return;
     }
 
-    return (Task){.sync_info = Task__Empty};
+    parked->next = head;
+  } while (!a_cxweak_acqrel(&signal->waiters, &head, parked));
+}
+
+static void requeue_woken(WorkerState *self) {
+  ParkedTask *woken = a_xchg_acq(&self->woken, NULL);
+
+  // The list is newest first; put them back in the order they were woken
+  ParkedTask *ordered = NULL;
+  while (woken) {
+    ParkedTask *next = woken->next;
+    woken->next = ordered;
+    ordered = woken;
+    woken = next;
+  }
+
+  s64 placed = 0;
+  while (ordered) {
+    ParkedTask *next = ordered->next;
+    placed += ordered->placed;
+    requeue(self, &ordered->data);
+    ParkedTask__free(self, ordered);
+    ordered = next;
+  }
+
+  // They're on the deques now, where `worker_load` sees them anyway
+  if (placed) a_add_rlx(&self->inbound, -placed);
+}
+
+TaskProgress task_block_on(TaskSignal *signal) {
+  WorkerState *self = this_cpu()->worker;
+  assert(self, "only tasks can block");
+
+  self->blocked_on = signal;
+  return Blocked;
+}
+
+// Hands each of `waiters` back to the worker it blocked on
+static void wake_parked(ParkedTask *waiters) {
+  while (waiters) {
+    ParkedTask *next = waiters->next;
+    WorkerState *home = waiters->home;
+
+    ParkedTask *head = a_load_rlx(&home->woken);
+    do {
+      waiters->next = head;
+    } while (!a_cxweak_rel(&home->woken, &head, waiters));
+
+    // Nobody else can run these, so the worker has to wake up for them
+    wake_if_sleeping(home);
+    waiters = next;
   }
+}
+
+void task_signal_set(TaskSignal *signal) {
+  ParkedTask *waiters = a_xchg_acqrel(&signal->waiters, SIGNAL_SET);
+  if (waiters == SIGNAL_SET) return;
 
-  return task;
+  wake_parked(waiters);
 }
 
-static bool enqueue_task(WorkerState *worker, TaskData data) {
-  Task *const tasks = worker->tasks;
-  const s32 task_count = worker->task_count;
-  const s64 read_from = a_load(&worker->read_from), upper_bound = read_from + task_count;
-  s64 write_to = a_load(&worker->write_to);
+TaskProgress task_wait_if(const _Atomic u32 *address, u32 expected) {
+  WorkerState *self = this_cpu()->worker;
+  assert(self, "only tasks can block");
+
+  self->waiting_on = address;
+  self->waiting_for = expected;
+  return Blocked;
+}
 
-  LOOP(find_slot) {
-    u8 current = Task__Empty;
-    Task *target = &tasks[write_to % task_count];
-    if (a_cxstrong(&target->sync_info, &current, Task__Writing)) {
-      target->id = a_add(&TaskGlobals.next_id, 1);
-      target->data = data;
+s64 task_wake(const _Atomic u32 *address, s64 count) {
+  WaitBucket *bucket = wait_bucket(address);
+  ParkedTask *woken = NULL, **woken_tail = &woken;
+  s64 woken_count = 0;
 
-      // we have mutual exclusion here, so we just write directly
-      a_store(&target->sync_info, Task__Queued);
+  const u64 flags = irq_save();
+  TicketLock__lock(&bucket->lock);
 
-      break(find_slot);
+  ParkedTask **link = &bucket->head;
+  while (*link && woken_count < count) {
+    ParkedTask *waiter = *link;
+    if (waiter->address != address) {
+      link = &waiter->next;
+      continue;
     }
 
-    while (write_to < upper_bound) {
-      if (a_cxweak(&worker->write_to, &write_to, write_to + 1)) continue(find_slot);
+    *link = waiter->next;
+    if (bucket->tail == &waiter->next) bucket->tail = link;
+
+    waiter->next = NULL;
+    *woken_tail = waiter;
+    woken_tail = &waiter->next;
+    woken_count++;
+  }
+
+  TicketLock__unlock(&bucket->lock);
+  irq_restore(flags);
+
+  wake_parked(woken);
+  return woken_count;
+}
+
+void task_signal_reset(TaskSignal *signal) {
+  ParkedTask *expected = SIGNAL_SET;
+  a_cxstrong(&signal->waiters, &expected, NULL);
+}
+
+bool task_signal_is_set(TaskSignal *signal) {
+  return a_load_acq(&signal->waiters) == SIGNAL_SET;
+}
+
+// xorshift64
+static s64 random_worker(WorkerState *self) {
+  u64 rng = self->rng;
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  self->rng = rng;
+
+  return S64(rng % U64(TaskGlobals.worker_count));
+}
+
+// Try each other worker's deque for `priority` once, starting at a random one so
+// that idle workers don't all pile onto the same victim
+static s64 steal_tasks(WorkerState *self, TaskPriority priority, Task *out) {
+  const s64 count = TaskGlobals.worker_count;
+  const s64 start = random_worker(self);
+  RANGE(S64(0), count) {
+    WorkerState *victim = &TaskGlobals.workers[(start + it) % count];
+    if (victim == self) continue;
+
+    // Losing the race means some other worker made progress, so just go again
+    StealResult result;
+    s64 stolen;
+    TaskDeque *deque = &victim->deques[priority];
+    while ((result = TaskDeque__steal(deque, out, STEAL_BATCH_MAX, &stolen)) == StealRetry)
+      pause();
+
+    if (result == Stolen) return stolen;
+  }
+
+  return 0;
+}
+
+static s64 TaskArray__pages(s64 count) {
+  const s64 size = S64(sizeof(TaskArray)) + count * S64(sizeof(Task));
+  return align_up(size, _4KB) / _4KB;
+}
+
+static TaskArray *TaskArray__new(s64 count) {
+  assert(count > 0 && (count & (count - 1)) == 0, "deque size wasn't a power of 2");
+
+  TaskArray *array = raw_pages(TaskArray__pages(count));
+  ensure(array) return NULL;
+
+  array->mask = count - 1;
+  return array;
+}
+
+// Pushes as many of `items` as fit, growing the deque first if needed, and
+// publishes all of them with a single store. Returns how many were pushed.
+static s64 TaskDeque__push(TaskDeque *deque, const TaskData *items, s64 count, u64 queued_at) {
+  const s64 bottom = a_load_rlx(&deque->bottom), top = a_load_acq(&deque->top);
+  TaskArray *array = a_load_rlx(&deque->array);
+
+  s64 slots = array->mask + 1;
+  if (bottom - top + count > slots && slots < DEQUE_MAX_COUNT) {
+    while (bottom - top + count > slots && slots < DEQUE_MAX_COUNT)
+      slots *= 2;
+
+    TaskArray *bigger = TaskArray__new(slots);
+    if (bigger) {
+      for (s64 i = top; i < bottom; i++)
+        bigger->tasks[i & bigger->mask] = array->tasks[i & array->mask];
+
+      // A thief could still be reading the old array, so it has to wait until
+      // every worker has been back through its loop
+      a_store_rel(&deque->array, bigger);
+      epoch_retire(array, TaskArray__pages(array->mask + 1));
+      array = bigger;
+      deque->growths++;
     }
+  }
 
-    return false;
+  count = min(count, array->mask + 1 - (bottom - top));
+  RANGE(S64(0), count) {
+    array->tasks[(bottom + it) & array->mask] = (Task){.data = items[it], .queued_at = queued_at};
   }
 
-  return true;
+  // Releases the tasks to thieves, who acquire `bottom`
+  if (count > 0) a_store_rel(&deque->bottom, bottom + count);
+  return count;
+}
+
+static bool TaskDeque__pop(TaskDeque *deque, Task *out) {
+  const s64 bottom = a_load_rlx(&deque->bottom) - 1;
+
+  // Only the owner moves `bottom`, and `top` never goes down, so this can't be
+  // wrong about the deque being empty, even with a stale `top`. It keeps idle
+  // workers from writing to their own deques over and over.
+  if (bottom < a_load_rlx(&deque->top)) return false;
+
+  // `bottom` has to be published before `top` is read, so that a thief can't
+  // take the same task. That's a store-load ordering, which only a full fence
+  // gives; it pairs with the one in `TaskDeque__steal`.
+  TaskArray *array = a_load_rlx(&deque->array);
+  a_store_rlx(&deque->bottom, bottom);
+  a_fence();
+  const s64 top = a_load_rlx(&deque->top);
+
+  // A thief that claims tasks starting from `top` takes at most
+  // `STEAL_BATCH_MAX` of them, so this task is out of its reach.
+  if (bottom - top >= STEAL_BATCH_MAX) {
+    *out = array->tasks[bottom & array->mask];
+    return true;
+  }
+
+  // Otherwise, take from the top like any other thief would
+  a_store_rlx(&deque->bottom, bottom + 1);
+
+  StealResult result;
+  s64 stolen;
+  while ((result = TaskDeque__steal(deque, out, 1, &stolen)) == StealRetry)
+    pause();
+
+  return result == Stolen;
+}
+
+// Once a deque that grew for a burst drains, go back to the initial size, so
+// that bursts don't pin memory forever. Only the owner pushes, so an empty deque
+// stays empty until it's done; a thief with a stale view of it will fail its
+// CAS on `top` no matter which array it reads.
+static void TaskDeque__shrink(TaskDeque *deque) {
+  TaskArray *array = a_load_rlx(&deque->array);
+  if (array->mask + 1 == DEQUE_INITIAL_COUNT) return;
+  if (a_load_rlx(&deque->bottom) != a_load_acq(&deque->top)) return;
+
+  TaskArray *smaller = TaskArray__new(DEQUE_INITIAL_COUNT);
+  if (!smaller) return;
+
+  a_store_rel(&deque->array, smaller);
+  epoch_retire(array, TaskArray__pages(array->mask + 1));
+}
+
+// Takes the oldest task in the deque if it's past its deadline. Only the owner
+// calls this; it claims the task the same way a thief would.
+static bool TaskDeque__take_late(TaskDeque *deque, u64 now, Task *out) {
+  const s64 top = a_load_acq(&deque->top);
+  if (top >= a_load_rlx(&deque->bottom)) return false;
+
+  // Only the owner writes slots, so this one can't change under us. If a thief
+  // takes it first, the steal below gets the next one, late or not.
+  TaskArray *array = a_load_rlx(&deque->array);
+  const u64 deadline = array->tasks[top & array->mask].data.deadline;
+  if (!deadline || deadline > now) return false;
+
+  s64 stolen;
+  return TaskDeque__steal(deque, out, 1, &stolen) == Stolen;
+}
+
+// Claims up to half of the tasks in the deque, and at most `max`
+static StealResult TaskDeque__steal(TaskDeque *deque, Task *out, s64 max, s64 *count) {
+  s64 top = a_load_acq(&deque->top);
+  a_fence();
+  const s64 bottom = a_load_acq(&deque->bottom);
+  if (top >= bottom) return StealEmpty;
+
+  const s64 taken = min(min((bottom - top + 1) / 2, max), S64(STEAL_BATCH_MAX));
+
+  // The slots can be overwritten as soon as `top` moves past them, so they have
+  // to be copied out before claiming them.
+  TaskArray *array = a_load_acq(&deque->array);
+  RANGE(S64(0), taken) {
+    out[it] = array->tasks[(top + it) & array->mask];
+  }
+
+  if (!a_cxstrong(&deque->top, &top, top + taken)) return StealRetry;
+
+  *count = taken;
+  return Stolen;
+}
+
+// Pushes as many of `items` as it can allocate room for, all under one lock
+static s64 Injector__push(Injector *injector, const TaskData *items, s64 count,
+                          InjectorSource source) {
+  if (count == 0) return 0;
+
+  const u64 queued_at = asm_rdtsc();
+
+  TicketLock__lock(&injector->lock);
+
+  s64 pushed = 0;
+  while (pushed < count) {
+    TaskChunk *tail = injector->tail;
+    if (!tail || tail->write_to == CHUNK_TASK_COUNT) {
+      TaskChunk *chunk = raw_pages(1);
+      if (!chunk) break;
+
+      *chunk = (TaskChunk){0};
+      if (tail) tail->next = chunk;
+      else
+        injector->head = chunk;
+
+      injector->tail = tail = chunk;
+    }
+
+    const s64 batch = min(count - pushed, CHUNK_TASK_COUNT - tail->write_to);
+    RANGE(S64(0), batch) {
+      tail->tasks[tail->write_to + it] = (Task){.data = items[pushed + it], .queued_at = queued_at};
+    }
+
+    tail->write_to += batch;
+    pushed += batch;
+  }
+
+  const s64 previous = a_add_rlx(&injector->count, pushed);
+  const s64 total = previous + pushed;
+
+  SeqLock__write_begin(&injector->stats_seq);
+  injector->peak = max(injector->peak, total);
+  if (previous <= INJECTOR_BACKPRESSURE && total > INJECTOR_BACKPRESSURE)
+    injector->backpressure_events++;
+
+  switch (source) {
+  case FromOverflow:
+    injector->overflows += pushed;
+    break;
+  case FromRemote:
+    injector->remote_submits += pushed;
+    break;
+  case FromRequeue:
+    injector->requeues += pushed;
+    break;
+  }
+  SeqLock__write_end(&injector->stats_seq);
+
+  TicketLock__unlock(&injector->lock);
+  return pushed;
+}
+
+static s64 Injector__pop(Injector *injector, Task *out, s64 max) {
+  // Workers check this every time their deque is empty, so don't touch the lock
+  // unless there's something to take
+  if (!a_load_rlx(&injector->count)) return 0;
+
+  TicketLock__lock(&injector->lock);
+
+  TaskChunk *finished = NULL;
+  s64 popped = 0;
+  while (popped < max) {
+    TaskChunk *head = injector->head;
+    if (!head || head->read_from == head->write_to) break;
+
+    const s64 batch = min(max - popped, head->write_to - head->read_from);
+    RANGE(S64(0), batch) {
+      out[popped + it] = head->tasks[head->read_from + it];
+    }
+
+    head->read_from += batch;
+    popped += batch;
+
+    if (head->read_from == CHUNK_TASK_COUNT) {
+      injector->head = head->next;
+      if (!injector->head) injector->tail = NULL;
+
+      head->next = finished;
+      finished = head;
+    }
+  }
+
+  a_add_rlx(&injector->count, -popped);
+  TicketLock__unlock(&injector->lock);
+
+  while (finished) {
+    TaskChunk *next = finished->next;
+    release_pages(finished, 1);
+    finished = next;
+  }
+
+  return popped;
+}
+
+static HANDLER idle_wakeup(ExceptionStackFrame *frame) {
+  (void)frame;
+  apic_eoi();
+}
+
+static void wake_worker(WorkerState *worker) {
+  a_add_rlx(&TaskGlobals.wakeups, 1);
+
+  // With MWAIT, clearing `sleeping` was already enough
+  if (TaskGlobals.use_mwait) return;
+
+  apic_send_ipi(cpu_of(worker - TaskGlobals.workers)->core_id, INT_TASK_WAKEUP);
+}
+
+static void wake_if_sleeping(WorkerState *worker) {
+  // Pairs with the full barriers in `idle_sleep`: either this sees the worker
+  // asleep, or the worker sees what was just published
+  a_fence();
+
+  bool sleeping = true;
+  if (a_load_rlx(&worker->sleeping) && a_cxstrong(&worker->sleeping, &sleeping, false))
+    wake_worker(worker);
+}
+
+// Wake up one sleeping worker other than `self`, if there are any. Checking
+// costs producers a fence, and one load of a line that rarely changes.
+static void wake_idle_worker(const WorkerState *self) {
+  // Without this, the load could be answered before the push that came before
+  // it is visible, and miss a worker that went to sleep in between
+  a_fence();
+  if (!a_load_rlx(&TaskGlobals.sleeping)) return;
+
+  const s64 count = TaskGlobals.worker_count;
+  const s64 start = self ? self - TaskGlobals.workers + 1 : 0;
+  RANGE(S64(0), count) {
+    WorkerState *worker = &TaskGlobals.workers[(start + it) % count];
+    if (worker == self || !a_load_rlx(&worker->sleeping)) continue;
+
+    bool sleeping = true;
+    if (!a_cxstrong(&worker->sleeping, &sleeping, false)) continue;
+
+    wake_worker(worker);
+    return;
+  }
+}
+
+// Whether there's anything this worker could find if it looked again
+static bool work_visible(const WorkerState *self) {
+  if (a_load_rlx(&self->woken)) return true;
+
+  FOR_PTR(TaskGlobals.injectors, PRIORITY_COUNT) {
+    if (a_load_rlx(&it->count)) return true;
+  }
+
+  FOR_PTR(TaskGlobals.workers, TaskGlobals.worker_count, worker) {
+    FOR_PTR(worker->deques, PRIORITY_COUNT, deque) {
+      if (a_load_rlx(&deque->top) < a_load_rlx(&deque->bottom)) return true;
+    }
+  }
+
+  return false;
+}
+
+// Advertise this worker as asleep, look for work one more time, and then sleep
+// until someone wakes it up. Producers fence between publishing work and
+// checking for sleepers, so one of the two always sees the other. The timer
+// tick still wakes workers up every THREAD_TICK_US, so sleeping workers hold
+// up epoch reclamation for at most that long.
+static void idle_sleep(WorkerState *self) {
+  // These are full barriers, so the checks below can't be answered from
+  // before anyone could see that this worker is asleep
+  a_store(&self->sleeping, true);
+  a_add(&TaskGlobals.sleeping, 1);
+
+  if (!work_visible(self)) {
+    if (TaskGlobals.use_mwait) {
+      asm_monitor(&self->woken);
+      if (a_load_rlx(&self->sleeping)) asm_mwait();
+    } else {
+      // With interrupts off, a wakeup IPI that comes in after the check waits
+      // for the `hlt`, and ends it
+      asm_cli();
+      if (a_load_rlx(&self->sleeping)) asm_sti_hlt();
+      else
+        asm_sti();
+    }
+  }
+
+  a_store_rlx(&self->sleeping, false);
+  a_add_rlx(&TaskGlobals.sleeping, -1);
+  self->sleeps++;
+  self->idle_rounds = 0;
 }
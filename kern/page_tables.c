@@ -1,8 +1,12 @@
 #include "asm.h"
+#include "cpu.h"
 #include "memory.h"
+#include "multitasking.h"
 #include "page_tables.h"
+#include "tlb.h"
 #include <basics.h>
 #include <macros.h>
+#include <sync.h>
 
 #define ENTRY_COUNT 512
 typedef struct {
@@ -27,12 +31,203 @@ typedef struct {
   };
 } PageTableIndices;
 
+// Each core hands out process-context IDs from a small set of slots. Switching
+// to a table that's already in a slot reuses its PCID without flushing the TLB;
+// otherwise the least-recently-assigned slot is recycled, and the CR3 write
+// flushes whatever the old owner of that PCID left behind. PCID 0 is never
+// handed out, so the tables used before `pcid__init_core` can't collide.
+#define PCID_SLOT_COUNT 8
+#define CR3_PCID        U64(0xfff)
+#define CR3_NO_FLUSH    (U64(1) << 63)
+
+typedef struct {
+  PageTable4 *_Atomic active;
+  PageTable4 *_Atomic slots[PCID_SLOT_COUNT]; // slot `i` owns PCID `i + 1`
+  u8 next_slot;
+  bool enabled;
+
+  s64 hits;
+  s64 misses;
+} CACHE_ALIGNED PcidState;
+
+static PcidState PcidStates[CPU_MAX];
+
+void pcid__init_core(void) {
+  PcidState *state = &PcidStates[cpu_index()];
+  if (!(asm_cpuid(1).ecx & CPUID_ECX_PCID)) return;
+
+  // CR4.PCIDE can only be set while the current PCID is 0
+  assert((read_register(cr3, u64, "q") & CR3_PCID) == 0);
+
+  const u64 cr4 = read_register(cr4, u64, "q");
+  write_register(cr4, cr4 | CR4_PCIDE, "q");
+  state->enabled = true;
+}
+
+PcidStats pcid_stats(void) {
+  PcidStats stats = {0};
+  FOR_PTR(PcidStates, cpu_count()) {
+    stats.hits += it->hits;
+    stats.misses += it->misses;
+  }
+
+  return stats;
+}
+
+PageTable4 *active_page_table(s64 cpu) {
+  return a_load(&PcidStates[cpu].active);
+}
+
+void pcid_forget(s64 cpu, PageTable4 *p4) {
+  PcidState *state = &PcidStates[cpu];
+  PageTable4 *const active = a_load(&state->active);
+
+  RANGE(0, PCID_SLOT_COUNT, slot) {
+    PageTable4 *current = a_load(&state->slots[slot]);
+    if (p4 == NULL ? current == active : current != p4) continue;
+
+    a_cxstrong(&state->slots[slot], &current, NULL);
+  }
+}
+
 PageTable4 *get_page_table(void) {
-  return kernel_ptr(read_register(cr3, u64, "q"));
+  return kernel_ptr(read_register(cr3, u64, "q") & PTE_ADDRESS);
+}
+
+static void load_page_table(PcidState *state, PageTable4 *p4) {
+  const u64 table = physical_address(p4);
+
+  // This has to be published before looking at the slots; TLB shootdowns drop
+  // slots first and then check `active`, so one side always sees the other.
+  a_store(&state->active, p4);
+
+  if (!state->enabled) {
+    write_register(cr3, table);
+    return;
+  }
+
+  RANGE(0, PCID_SLOT_COUNT, slot) {
+    if (a_load(&state->slots[slot]) != p4) continue;
+
+    state->hits++;
+    write_register(cr3, table | U64(slot + 1) | CR3_NO_FLUSH, "q");
+    return;
+  }
+
+  const u8 slot = state->next_slot;
+  state->next_slot = U8((slot + 1) % PCID_SLOT_COUNT);
+  a_store(&state->slots[slot], p4);
+
+  state->misses++;
+  write_register(cr3, table | U64(slot + 1), "q");
 }
 
 void set_page_table(PageTable4 *p4) {
-  write_register(cr3, physical_address(p4));
+  // The state has to be the one for the core whose CR3 gets written
+  preempt_disable();
+  load_page_table(&PcidStates[cpu_index()], p4);
+  preempt_enable();
+}
+
+// Page-table pages are recycled through a per-core pool instead of going back
+// to the global allocator each time. Freed tables are zeroed by a background
+// task and then handed back to the owning core, so allocating a table is
+// usually just popping a list.
+#define POOL_CAPACITY 64
+
+typedef struct PoolPage {
+  struct PoolPage *next;
+} PoolPage;
+
+typedef struct {
+  PoolPage *clean; // zeroed, except for the link; only touched by the owner
+
+  // Both lists are only ever pushed to one page at a time, and emptied all at
+  // once, so they don't suffer from ABA.
+  PoolPage *_Atomic zeroed; // zeroed by the background task, not yet in `clean`
+  PoolPage *_Atomic dirty;  // freed, waiting to be zeroed
+
+  _Atomic s64 held; // pages across all three lists
+  _Atomic bool zeroing_queued;
+} CACHE_ALIGNED PageTablePool;
+
+static PageTablePool PageTablePools[CPU_MAX];
+
+static void PoolPage__push(PoolPage *_Atomic *list, PoolPage *page) {
+  PoolPage *head = a_load(list);
+  do {
+    page->next = head;
+  } while (!a_cxweak(list, &head, page));
+}
+
+static TaskProgress zero_dirty_tables(void *data, s64 size) {
+  PageTablePool *pool = data;
+  (void)size;
+
+  // Reset this first, so that tables freed after the exchange queue another run
+  a_store(&pool->zeroing_queued, false);
+
+  PoolPage *page = a_xchg(&pool->dirty, NULL);
+  while (page) {
+    PoolPage *next = page->next;
+    memset(page, 0, _4KB);
+    PoolPage__push(&pool->zeroed, page);
+    page = next;
+  }
+
+  return Done;
+}
+
+static PageTable *alloc_table(void) {
+  const u64 flags = irq_save();
+  PageTablePool *pool = &PageTablePools[cpu_index()];
+  if (!pool->clean) pool->clean = a_xchg(&pool->zeroed, NULL);
+
+  PoolPage *page = pool->clean;
+  if (page) {
+    pool->clean = page->next;
+    page->next = NULL;
+    a_add(&pool->held, -1);
+    irq_restore(flags);
+    return (PageTable *)page;
+  }
+
+  // Nothing's been zeroed yet, but zeroing a recycled page here is still
+  // cheaper than going through the buddy allocator. The owner is the only one
+  // that pushes to `dirty`, so popping here can't see a recycled head.
+  page = a_load(&pool->dirty);
+  while (page && !a_cxweak(&pool->dirty, &page, page->next))
+    ;
+
+  irq_restore(flags);
+  if (!page) return zeroed_pages(1);
+
+  a_add(&pool->held, -1);
+  memset(page, 0, _4KB);
+  return (PageTable *)page;
+}
+
+static void free_table(PageTable *table) {
+  const u64 flags = irq_save();
+  PageTablePool *pool = &PageTablePools[cpu_index()];
+  if (a_load(&pool->held) >= POOL_CAPACITY) {
+    irq_restore(flags);
+    release_pages(table, 1);
+    return;
+  }
+
+  a_add(&pool->held, 1);
+  PoolPage__push(&pool->dirty, (PoolPage *)table);
+  const bool queued = a_xchg(&pool->zeroing_queued, true);
+  irq_restore(flags);
+
+  // Nothing's waiting on the zeroing, so it shouldn't hold anything else up
+  const TaskData zeroing = {
+      .code = zero_dirty_tables, .data = pool, .priority = PriorityBackground};
+  if (queued) return;
+
+  // The next table freed here gets to try again
+  if (!add_task_inner(zeroing)) a_store(&pool->zeroing_queued, false);
 }
 
 static PageTableIndices page_table_indices(u64 address) {
@@ -90,6 +285,42 @@ void UNSAFE_HACKY_higher_half_init() {
   write_register(cr3, table);
 }
 
+// Every address space shares the kernel half's P3 tables, which are all
+// allocated up front; that way kernel mappings only ever change below the P4
+// level, and show up everywhere at once.
+#define KERNEL_HALF_BEGIN (ENTRY_COUNT / 2)
+#define KERNEL_P4_FLAGS   (PTE_PRESENT | PTE_WRITABLE | PTE_NOT_EMPTY)
+
+static PageTable4 *KernelTable;
+
+void set_kernel_table(PageTable4 *_p4) {
+  assert(!KernelTable);
+  PageTable *p4 = (PageTable *)_p4;
+
+  RANGE(KERNEL_HALF_BEGIN, ENTRY_COUNT, entry) {
+    if (p4->entries[entry]) continue;
+
+    PageTable *p3 = alloc_table();
+    assert(p3);
+    p4->entries[entry] = make_pte(p3, KERNEL_P4_FLAGS);
+  }
+
+  KernelTable = _p4;
+}
+
+PageTable4 *new_page_table(void) {
+  assert(KernelTable);
+
+  PageTable *p4 = alloc_table();
+  ensure(p4) return NULL;
+
+  const PageTable *kernel = (const PageTable *)KernelTable;
+  memcpy((void *)&p4->entries[KERNEL_HALF_BEGIN], (const void *)&kernel->entries[KERNEL_HALF_BEGIN],
+         sizeof(u64) * (ENTRY_COUNT - KERNEL_HALF_BEGIN));
+
+  return (PageTable4 *)p4;
+}
+
 bool copy_mapping(PageTable4 *dest, PageTable4 *src, u64 virt, s64 count, u64 flags) {
   virt = align_down(virt, _4KB);
 
@@ -129,9 +360,14 @@ void *translate(PageTable4 *_p4, u64 virtual) {
   PageTable *p3 = pte_address(p4->entries[indices.p4]);
   ensure(p3) return NULL;
 
-  PageTable *p2 = pte_address(p3->entries[indices.p3]);
+  const u64 p3_entry = p3->entries[indices.p3];
+  PageTable *p2 = pte_address(p3_entry);
   ensure(p2) return NULL;
 
+  if (p3_entry & PTE_HUGE_PAGE) {
+    return (u8 *)p2 + virtual % _1GB;
+  }
+
   const u64 p2_entry = p2->entries[indices.p2];
   u8 *page = pte_address(p2_entry);
   ensure(page) return NULL;
@@ -141,7 +377,10 @@ void *translate(PageTable4 *_p4, u64 virtual) {
   }
 
   PageTable *p1 = (PageTable *)page;
-  return pte_address(p1->entries[indices.p1]) + indices.p0;
+  page = pte_address(p1->entries[indices.p1]);
+  ensure(page) return NULL;
+
+  return page + indices.p0;
 }
 // TODO this shouldn't return a void* bc the page table might not be valid. Should
 // probably just return bool.
@@ -179,7 +418,8 @@ bool map_page(PageTable4 *_p4, u64 virtual, const void *kernel, u64 flags) {
 
   PageTable *p3 = pte_address(p4->entries[indices.p4]);
   ensure(p3) {
-    p3 = zeroed_pages(1);
+    assert(!KernelTable || indices.p4 < KERNEL_HALF_BEGIN, "kernel half should be preallocated");
+    p3 = alloc_table();
     ensure(p3) return false;
 
     p4->entries[indices.p4] = make_pte(p3, flags);
@@ -187,7 +427,7 @@ bool map_page(PageTable4 *_p4, u64 virtual, const void *kernel, u64 flags) {
 
   PageTable *p2 = pte_address(p3->entries[indices.p3]);
   ensure(p2) {
-    p2 = zeroed_pages(1);
+    p2 = alloc_table();
     ensure(p2) return false;
 
     p3->entries[indices.p3] = make_pte(p2, flags);
@@ -195,7 +435,7 @@ bool map_page(PageTable4 *_p4, u64 virtual, const void *kernel, u64 flags) {
 
   PageTable *p1 = pte_address(p2->entries[indices.p2]);
   ensure(p1) {
-    p1 = zeroed_pages(1);
+    p1 = alloc_table();
     ensure(p1) return false;
 
     p2->entries[indices.p2] = make_pte(p1, flags);
@@ -217,7 +457,8 @@ bool map_2MB_page(PageTable4 *_p4, u64 virtual, const void *kernel, u64 flags) {
 
   PageTable *p3 = pte_address(p4->entries[indices.p4]);
   ensure(p3) {
-    p3 = zeroed_pages(1);
+    assert(!KernelTable || indices.p4 < KERNEL_HALF_BEGIN, "kernel half should be preallocated");
+    p3 = alloc_table();
     ensure(p3) return false;
 
     p4->entries[indices.p4] = make_pte(p3, flags);
@@ -225,7 +466,7 @@ bool map_2MB_page(PageTable4 *_p4, u64 virtual, const void *kernel, u64 flags) {
 
   PageTable *p2 = pte_address(p3->entries[indices.p3]);
   ensure(p2) {
-    p2 = zeroed_pages(1);
+    p2 = alloc_table();
     ensure(p2) return false;
 
     p3->entries[indices.p3] = make_pte(p2, flags);
@@ -237,6 +478,133 @@ bool map_2MB_page(PageTable4 *_p4, u64 virtual, const void *kernel, u64 flags) {
   return true;
 }
 
+// Walking state for `unmap_region` and `protect_region`
+typedef struct {
+  bool unmap;
+  u64 flags;
+  TlbBatch tlb;
+
+  // Tables emptied by an unmap, linked through their first entry. They can't be
+  // freed until the TLB flush is done, because other cores might still have
+  // them in their paging-structure caches.
+  PageTable *freed;
+} RegionEdit;
+
+static u64 level_size(u8 level) {
+  return U64(_4KB) << (9 * (level - 1));
+}
+
+static bool table_is_empty(const PageTable *table) {
+  FOR_PTR(table->entries, ENTRY_COUNT) {
+    if (*it) return false;
+  }
+
+  return true;
+}
+
+// Replace a huge page entry at `level` with a table that maps the same memory
+// using pages of the next size down.
+static bool split_huge_page(volatile u64 *entry, u8 level) {
+  const u64 old = *entry;
+  const u64 flags = old & ~(PTE_ADDRESS | PTE_HUGE_PAGE);
+  const u64 child_flags = level > 2 ? flags | PTE_HUGE_PAGE : flags;
+  const u64 child_size = level_size(level - 1);
+
+  PageTable *child = alloc_table();
+  ensure(child) return false;
+
+  FOR_PTR(child->entries, ENTRY_COUNT) {
+    *it = ((old & PTE_ADDRESS) + U64(index) * child_size) | child_flags;
+  }
+
+  *entry = make_pte(child, flags);
+  return true;
+}
+
+// Intermediate entries limit what the pages below them can do, so they need to
+// be at least as permissive as `flags`.
+static u64 loosen_entry(u64 entry, u64 flags) {
+  entry |= flags & (PTE_WRITABLE | PTE_USER_ACCESSIBLE);
+  if (!(flags & PTE_NO_EXECUTE)) entry &= ~PTE_NO_EXECUTE;
+  return entry;
+}
+
+// Edit the entries of `table` (at `level`) for the addresses `virt..=last`.
+// `last` is inclusive so that ranges can end at the top of the address space.
+static bool edit_table(RegionEdit *edit, PageTable *table, u8 level, u64 virt, u64 last) {
+  const u64 size = level_size(level);
+  const u8 shift = U8(12 + 9 * (level - 1));
+
+  while (true) {
+    const u64 entry_begin = align_down(virt, size), entry_last = entry_begin + (size - 1);
+    const u64 chunk_last = min(entry_last, last);
+    volatile u64 *entry = &table->entries[(virt >> shift) % ENTRY_COUNT];
+
+    const bool leaf = level == 1 || (*entry & PTE_HUGE_PAGE);
+    const bool whole = virt == entry_begin && chunk_last == entry_last;
+    if (*entry == 0) {
+      // Nothing mapped here
+    } else if (leaf && whole) {
+      *entry = edit->unmap ? 0 : (*entry & (PTE_ADDRESS | PTE_HUGE_PAGE)) | edit->flags;
+      TlbBatch__add(&edit->tlb, entry_begin, S64(size / _4KB));
+    } else {
+      if (leaf) {
+        bool res = split_huge_page(entry, level);
+        ensure(res) return false;
+      }
+
+      if (!edit->unmap) *entry = loosen_entry(*entry, edit->flags);
+
+      PageTable *child = pte_address(*entry);
+      bool res = edit_table(edit, child, level - 1, virt, chunk_last);
+      ensure(res) return false;
+
+      // The kernel half's P3 tables are shared, so they stay even when empty
+      const bool shared = level == 4 && entry_begin >= MEMORY__KERNEL_SPACE_BEGIN;
+      if (edit->unmap && !shared && table_is_empty(child)) {
+        *entry = 0;
+        TlbBatch__add(&edit->tlb, entry_begin, 1);
+
+        child->entries[0] = (u64)edit->freed;
+        edit->freed = child;
+      }
+    }
+
+    if (chunk_last >= last) return true;
+    virt = chunk_last + 1;
+  }
+}
+
+static bool edit_region(RegionEdit *edit, PageTable4 *p4, u64 virt, s64 count) {
+  ensure(p4 != NULL && is_aligned(p4, _4KB)) return false;
+  ensure(is_aligned(virt, _4KB)) return false;
+  if (count <= 0) return true;
+
+  const u64 last = virt + U64(count) * _4KB - 1;
+  const bool res = edit_table(edit, (PageTable *)p4, 4, virt, last);
+
+  // One flush for the whole call, instead of one per page
+  TlbBatch__flush(&edit->tlb);
+
+  while (edit->freed) {
+    PageTable *table = edit->freed;
+    edit->freed = (PageTable *)table->entries[0];
+    free_table(table);
+  }
+
+  return res;
+}
+
+bool unmap_region(PageTable4 *p4, u64 virt, s64 count) {
+  RegionEdit edit = {.unmap = true, .flags = 0, .tlb = TlbBatch__new(p4), .freed = NULL};
+  return edit_region(&edit, p4, virt, count);
+}
+
+bool protect_region(PageTable4 *p4, u64 virt, s64 count, u64 flags) {
+  RegionEdit edit = {.unmap = false, .flags = flags, .tlb = TlbBatch__new(p4), .freed = NULL};
+  return edit_region(&edit, p4, virt, count);
+}
+
 static void destroy_bb_table_inner(PageTable *table, u64 entry, u8 level) {
   if (table == NULL) return;
   if (entry & PTE_HUGE_PAGE) return;
@@ -257,8 +625,20 @@ void destroy_bootboot_table(PageTable4 *p4) {
 }
 
 static void destroy_table_inner(PageTable *table, u64 entry, u8 level);
-void destroy_table(PageTable4 *p4) {
-  destroy_table_inner((PageTable *)p4, 0, 4);
+void destroy_table(PageTable4 *_p4) {
+  assert(_p4 != KernelTable);
+
+  RANGE(S64(0), cpu_count(), cpu) {
+    pcid_forget(cpu, _p4);
+  }
+
+  // Only the user half belongs to this table
+  PageTable *p4 = (PageTable *)_p4;
+  FOR_PTR(p4->entries, KERNEL_HALF_BEGIN) {
+    destroy_table_inner(pte_address(*it), *it, 3);
+  }
+
+  free_table(p4);
 }
 
 static void destroy_table_inner(PageTable *table, u64 entry, u8 level) {
@@ -272,7 +652,7 @@ static void destroy_table_inner(PageTable *table, u64 entry, u8 level) {
     }
   }
 
-  release_pages(table, 1);
+  free_table(table);
 }
 
 static void traverse_table_inner(u64 table_entry, u16 table_level);
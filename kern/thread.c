@@ -0,0 +1,347 @@
+#include "thread.h"
+#include "apic.h"
+#include "asm.h"
+#include "cpu.h"
+#include "init.h"
+#include "interrupts.h"
+#include "memory.h"
+#include "multitasking.h"
+#include "page_tables.h"
+#include <basics.h>
+#include <macros.h>
+#include <sync.h>
+
+#define THREAD_STACK_PAGES 4
+
+// Each slot in the stack window is a guard page followed by the stack
+#define THREAD_SLOT_PAGES (THREAD_STACK_PAGES + 1)
+#define THREAD_STACK_MAX  4096
+
+typedef enum {
+  ThreadRunning,
+  ThreadYielded,
+  ThreadPreempted,
+  ThreadWaiting,
+  ThreadWaitingIf,
+  ThreadExited
+} ThreadState;
+
+// Lives at the top of its own stack, so creating a thread is just taking a slot
+// out of the pool.
+//
+// Every switch between a thread and its worker happens with interrupts off, so
+// that the timer never sees `Cpu.thread` set while the worker's stack is the
+// one in use.
+struct Thread {
+  void *stack_pointer; // saved while the thread isn't running
+  void *return_to;     // the worker's stack, saved while the thread is running
+
+  ThreadCode code;
+  void *data;
+  ThreadState state;
+  TaskSignal *waiting_on;
+  const _Atomic u32 *waiting_on_address;
+  u32 waiting_for;
+  u64 started_at; // in timer ticks of the core it's running on
+
+  Thread *next; // in the free pool
+
+  // A voluntary switch is a function call, which the compiler already assumes
+  // clobbers the SSE registers. Preemption can happen anywhere, though, so they
+  // get saved here.
+  u8 fpu_state[512] __attribute__((aligned(16)));
+};
+
+static struct {
+  TicketLock lock; // protects the pool, and mapping new slots
+  Thread *free;
+  s64 slot_count;
+
+  _Atomic s64 spawned;
+  _Atomic s64 exited;
+  _Atomic s64 switches;
+  _Atomic s64 preempted;
+  _Atomic s64 lock_sleeps;
+
+  _Atomic u64 quantum; // in ticks
+} ThreadGlobals = {.quantum = THREAD_QUANTUM_US / THREAD_TICK_US};
+
+// Saves the callee-saved registers and the stack pointer into `*save`, and
+// restores them from `next`, which was saved the same way. Everything else is
+// caller-saved, so the compiler has already spilled whatever it needed.
+void thread_switch(void **save, void *next);
+
+// A new thread's first switch returns here, with the thread in rbx and its
+// entry point in r12.
+extern char thread_trampoline[];
+
+asm(".text\n"
+    ".global thread_switch\n"
+    "thread_switch:\n"
+    "  pushq %rbp\n"
+    "  pushq %rbx\n"
+    "  pushq %r12\n"
+    "  pushq %r13\n"
+    "  pushq %r14\n"
+    "  pushq %r15\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq %rsi, %rsp\n"
+    "  popq %r15\n"
+    "  popq %r14\n"
+    "  popq %r13\n"
+    "  popq %r12\n"
+    "  popq %rbx\n"
+    "  popq %rbp\n"
+    "  retq\n"
+    ".global thread_trampoline\n"
+    "thread_trampoline:\n"
+    "  movq %rbx, %rdi\n"
+    "  callq *%r12\n"
+    "  ud2\n");
+
+static _Noreturn void thread_start(Thread *thread) {
+  // Switches happen with interrupts off; see `Thread`
+  asm_sti();
+  thread->code(thread->data);
+
+  asm_cli();
+  thread->state = ThreadExited;
+  thread_switch(&thread->stack_pointer, thread->return_to);
+  __builtin_unreachable();
+}
+
+// Map a new stack under a guard page, with the lock held
+static Thread *map_slot(void) {
+  ensure(ThreadGlobals.slot_count < THREAD_STACK_MAX) return NULL;
+
+  const u64 slot_size = THREAD_SLOT_PAGES * _4KB;
+  const u64 slot = MEMORY__THREAD_STACKS_BEGIN + U64(ThreadGlobals.slot_count) * slot_size;
+
+  void *pages[THREAD_STACK_PAGES];
+  RANGE(S64(0), S64(THREAD_STACK_PAGES), i) {
+    pages[i] = raw_pages(1);
+    if (pages[i]) continue;
+
+    RANGE(S64(0), i) {
+      release_pages(pages[it], 1);
+    }
+
+    return NULL;
+  }
+
+  // The first page of the slot is the guard, and stays unmapped
+  PageTable4 *p4 = get_page_table();
+  RANGE(S64(0), S64(THREAD_STACK_PAGES)) {
+    assert(map_page(p4, slot + U64(it + 1) * _4KB, pages[it], PTE_KERNEL),
+           "couldn't map a thread stack");
+  }
+
+  ThreadGlobals.slot_count++;
+
+  const u64 top = slot + slot_size;
+  return (Thread *)align_down(top - sizeof(Thread), 16);
+}
+
+static Thread *Thread__alloc(void) {
+  TicketLock__lock(&ThreadGlobals.lock);
+
+  Thread *thread = ThreadGlobals.free;
+  if (thread) ThreadGlobals.free = thread->next;
+  else
+    thread = map_slot();
+
+  TicketLock__unlock(&ThreadGlobals.lock);
+  return thread;
+}
+
+static void Thread__free(Thread *thread) {
+  TicketLock__lock(&ThreadGlobals.lock);
+  thread->next = ThreadGlobals.free;
+  ThreadGlobals.free = thread;
+  TicketLock__unlock(&ThreadGlobals.lock);
+}
+
+// Runs the thread until it stops, and then does whatever it stopped for
+static TaskProgress thread_run(void *data, s64 size) {
+  (void)size;
+
+  Thread *thread = data;
+  a_add_rlx(&ThreadGlobals.switches, 1);
+
+  const u64 flags = irq_save();
+  Cpu *cpu = this_cpu();
+  cpu->thread = thread;
+  thread->started_at = cpu->ticks;
+  thread->state = ThreadRunning;
+
+  thread_switch(&thread->return_to, thread->stack_pointer);
+
+  cpu->thread = NULL;
+  irq_restore(flags);
+
+  switch (thread->state) {
+  case ThreadYielded:
+    assert(add_task(thread_run, thread, 0));
+    return Done;
+
+  // Round robin: to the back of the line, behind whatever was waiting while it
+  // ran
+  case ThreadPreempted:
+    assert(add_task_later((TaskData){.code = thread_run, .data = thread}));
+    return Done;
+
+  case ThreadWaiting:
+    return task_block_on(thread->waiting_on);
+
+  case ThreadWaitingIf:
+    return task_wait_if(thread->waiting_on_address, thread->waiting_for);
+
+  case ThreadExited:
+    Thread__free(thread);
+    a_add_rlx(&ThreadGlobals.exited, 1);
+    return Done;
+
+  case ThreadRunning:
+    break;
+  }
+
+  panic("thread stopped without saying why");
+}
+
+bool thread_spawn(ThreadCode code, void *data) {
+  Thread *thread = Thread__alloc();
+  ensure(thread) return false;
+
+  *thread = (Thread){.code = code, .data = data};
+
+  // What `thread_switch` pops, from the bottom up: r15, r14, r13, r12, rbx,
+  // rbp, and the return address. The padding keeps the stack 16-byte aligned
+  // at the call in the trampoline.
+  u64 *frame = (u64 *)thread - 9;
+  frame[3] = U64(thread_start);
+  frame[4] = U64(thread);
+  frame[6] = U64(thread_trampoline);
+  thread->stack_pointer = frame;
+
+  a_add_rlx(&ThreadGlobals.spawned, 1);
+  if (add_task(thread_run, thread, 0)) return true;
+
+  Thread__free(thread);
+  return false;
+}
+
+static void thread_stop(ThreadState state) {
+  const u64 flags = irq_save();
+  Thread *thread = this_cpu()->thread;
+  assert(thread, "only threads can stop");
+  assert(!this_cpu()->preempt_count, "threads can't stop while holding a lock");
+
+  thread->state = state;
+  thread_switch(&thread->stack_pointer, thread->return_to);
+
+  irq_restore(flags);
+}
+
+// Called from the timer interrupt, on the thread's stack. When the thread comes
+// back, the switch returns here and the interrupt returns into the thread.
+static void thread_preempt(Thread *thread) {
+  asm volatile("fxsave64 %0" : "=m"(thread->fpu_state));
+  thread->state = ThreadPreempted;
+  a_add_rlx(&ThreadGlobals.preempted, 1);
+
+  thread_switch(&thread->stack_pointer, thread->return_to);
+
+  asm volatile("fxrstor64 %0" : : "m"(thread->fpu_state));
+}
+
+static HANDLER thread_timer(ExceptionStackFrame *frame) {
+  (void)frame;
+  apic_eoi();
+
+  Cpu *cpu = this_cpu();
+  cpu->ticks++;
+
+  Thread *thread = cpu->thread;
+  if (!thread || cpu->preempt_count) return;
+  if (cpu->ticks - thread->started_at < a_load_rlx(&ThreadGlobals.quantum)) return;
+
+  thread_preempt(thread);
+}
+
+void threads__init(void) {
+  set_interrupt_handler(INT_APIC_TIMER, thread_timer);
+  log_fmt("threads INIT_COMPLETE (quantum is %fus)", THREAD_QUANTUM_US);
+}
+
+void threads__init_core(void) {
+  apic_timer_start(INT_APIC_TIMER, THREAD_TICK_US);
+}
+
+void thread_set_quantum_us(u64 quantum) {
+  a_store_rlx(&ThreadGlobals.quantum, max(quantum / THREAD_TICK_US, 1));
+}
+
+void thread_yield(void) {
+  thread_stop(ThreadYielded);
+}
+
+void thread_wait(TaskSignal *signal) {
+  Thread *thread = this_cpu()->thread;
+  assert(thread, "only threads can wait");
+
+  thread->waiting_on = signal;
+  thread_stop(ThreadWaiting);
+}
+
+void thread_wait_if(const _Atomic u32 *address, u32 expected) {
+  Thread *thread = this_cpu()->thread;
+  assert(thread, "only threads can wait");
+
+  thread->waiting_on_address = address;
+  thread->waiting_for = expected;
+  thread_stop(ThreadWaitingIf);
+}
+
+void SleepLock__lock(SleepLock *lock) {
+  u32 state = SleepLockFree;
+  if (a_cxstrong_acq(&lock->state, &state, SleepLockHeld)) return;
+
+  // Critical sections are usually short, so it's worth spinning for a little
+  // before paying for a trip through the scheduler
+  s64 delay = 1;
+  REPEAT(SLEEP_LOCK_SPINS) {
+    backoff(&delay);
+
+    state = SleepLockFree;
+    if (a_load_rlx(&lock->state) == SleepLockFree &&
+        a_cxstrong_acq(&lock->state, &state, SleepLockHeld))
+      return;
+  }
+
+  // Whoever holds it has to wake someone up now. Taking it this way leaves it
+  // marked as contended even if nobody else is waiting, which just costs an
+  // extra wake.
+  while (a_xchg_acq(&lock->state, SleepLockContended) != SleepLockFree) {
+    a_add_rlx(&ThreadGlobals.lock_sleeps, 1);
+    thread_wait_if(&lock->state, SleepLockContended);
+  }
+}
+
+void SleepLock__unlock(SleepLock *lock) {
+  if (a_xchg_rel(&lock->state, SleepLockFree) == SleepLockContended) task_wake(&lock->state, 1);
+}
+
+ThreadStats thread_stats(void) {
+  TicketLock__lock(&ThreadGlobals.lock);
+  const s64 stacks = ThreadGlobals.slot_count;
+  TicketLock__unlock(&ThreadGlobals.lock);
+
+  return (ThreadStats){
+      .stacks = stacks,
+      .spawned = a_load_rlx(&ThreadGlobals.spawned),
+      .exited = a_load_rlx(&ThreadGlobals.exited),
+      .switches = a_load_rlx(&ThreadGlobals.switches),
+      .preempted = a_load_rlx(&ThreadGlobals.preempted),
+      .lock_sleeps = a_load_rlx(&ThreadGlobals.lock_sleeps),
+  };
+}
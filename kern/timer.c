@@ -0,0 +1,267 @@
+#include "timer.h"
+#include "bootboot.h"
+#include "cpu.h"
+#include "init.h"
+#include "memory.h"
+#include "multitasking.h"
+#include "thread.h"
+#include <basics.h>
+#include <macros.h>
+#include <sync.h>
+
+// Each level has 64 slots, each 64 times as wide as the slots of the level under
+// it, so four levels cover 2^24 ticks, a bit over two hours. Timers further out
+// than that wait in the top level until they're in range.
+#define WHEEL_LEVELS    4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS     (1 << WHEEL_SLOT_BITS)
+#define WHEEL_MASK      U64(WHEEL_SLOTS - 1)
+
+// Most tasks queued at once when timers fire
+#define FIRE_BATCH 16
+
+// A timer sits in the lowest level where it's less than a full rotation away,
+// in the slot its expiry maps to there. Whenever the level under a slot wraps
+// around, the slot's timers get cascaded: each one goes back in relative to the
+// new time, so it ends up a level lower.
+//
+// Only the owning core fires timers, but any core can cancel them, so it's all
+// under a lock. It's almost never contended.
+struct TimerWheel {
+  CACHE_ALIGNED TicketLock lock;
+  u64 now; // last tick that's been processed; only the owner moves it
+  Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  Timer *free; // pool for `add_task_after`
+
+  s64 started;
+  s64 fired;
+  s64 cancelled;
+  s64 cascaded;
+};
+
+static struct {
+  TimerWheel *wheels;
+  s64 wheel_count;
+
+  CACHE_ALIGNED _Atomic s64 pending;
+} TimerGlobals;
+
+void timers__init(void) {
+  TimerGlobals.wheel_count = bb.numcores;
+  const s64 size = S64(sizeof(TimerWheel)) * TimerGlobals.wheel_count;
+  TimerGlobals.wheels = zeroed_pages(align_up(size, _4KB) / _4KB);
+  assert(TimerGlobals.wheels);
+
+  log_fmt("timers INIT_COMPLETE (%f levels of %f slots)", WHEEL_LEVELS, WHEEL_SLOTS);
+}
+
+// The timer interrupt bumps this on the core the wheel belongs to, so it can be
+// ahead of `now` while that core is busy
+static u64 wheel_ticks(TimerWheel *wheel) {
+  const Cpu *cpu = cpu_of(wheel - TimerGlobals.wheels);
+  return *(const volatile u64 *)&cpu->ticks;
+}
+
+static u64 us_to_ticks(u64 us) {
+  return (us + THREAD_TICK_US - 1) / THREAD_TICK_US;
+}
+
+static void wheel_insert(TimerWheel *wheel, Timer *timer) {
+  // Cascading can put back timers that are due on the tick being processed
+  const u64 expires = max(timer->expires, wheel->now);
+
+  s64 level = 0;
+  u64 index = expires;
+  while (level < WHEEL_LEVELS && index - (wheel->now >> (WHEEL_SLOT_BITS * level)) >= WHEEL_SLOTS) {
+    level++;
+    index = expires >> (WHEEL_SLOT_BITS * level);
+  }
+
+  // Out of range; park it in the top level's last slot before this one, which
+  // is as far out as it goes
+  if (level == WHEEL_LEVELS) {
+    level = WHEEL_LEVELS - 1;
+    index = (wheel->now >> (WHEEL_SLOT_BITS * level)) + WHEEL_SLOTS - 1;
+  }
+
+  Timer **slot = &wheel->slots[level][index & WHEEL_MASK];
+  timer->next = *slot;
+  if (timer->next) timer->next->prev_next = &timer->next;
+  timer->prev_next = slot;
+  *slot = timer;
+}
+
+static void wheel_remove(Timer *timer) {
+  *timer->prev_next = timer->next;
+  if (timer->next) timer->next->prev_next = timer->prev_next;
+}
+
+static void timer_arm(TimerWheel *wheel, Timer *timer, TaskData task, u64 delay_us,
+                      u64 period_us) {
+  // The tick that's in progress is partly over already, so it doesn't count
+  const u64 base = max(wheel->now, wheel_ticks(wheel));
+  timer->expires = base + us_to_ticks(delay_us) + 1;
+  timer->period = period_us ? max(us_to_ticks(period_us), 1) : 0;
+  timer->task = task;
+
+  // Every firing would share the payload, and the first to finish would free it
+  assert(!timer->period || task.payload == PayloadExternal || task.payload == PayloadInline,
+         "periodic timers can't own a copied payload");
+
+  if (!timer->period) a_add_rlx(&TimerGlobals.pending, 1);
+  a_store_rlx(&timer->wheel, wheel);
+  wheel_insert(wheel, timer);
+  wheel->started++;
+}
+
+void timer_start(Timer *timer, TaskData task, u64 delay_us, u64 period_us) {
+  assert(!a_load_rlx(&timer->wheel), "started a timer that's already pending");
+  timer->pooled = false;
+
+  TimerWheel *wheel = &TimerGlobals.wheels[cpu_index()];
+  TicketLock__lock(&wheel->lock);
+  timer_arm(wheel, timer, task, delay_us, period_us);
+  TicketLock__unlock(&wheel->lock);
+}
+
+bool timer_cancel(Timer *timer) {
+  TimerWheel *wheel = a_load_rlx(&timer->wheel);
+  ensure(wheel) return false;
+
+  TicketLock__lock(&wheel->lock);
+
+  // It could have fired while we were waiting for the lock
+  const bool pending = a_load_rlx(&timer->wheel) == wheel;
+  if (pending) {
+    wheel_remove(timer);
+    a_store_rlx(&timer->wheel, NULL);
+    if (!timer->period) a_add_rlx(&TimerGlobals.pending, -1);
+    wheel->cancelled++;
+  }
+
+  TicketLock__unlock(&wheel->lock);
+
+  // The task will never run, so nothing else is going to free its payload
+  if (pending) TaskData__release(&timer->task);
+  return pending;
+}
+
+bool add_task_after(u64 delay_us, TaskData task) {
+  TimerWheel *wheel = &TimerGlobals.wheels[cpu_index()];
+  TicketLock__lock(&wheel->lock);
+
+  if (!wheel->free) {
+    Timer *page = raw_pages(1);
+    if (!page) {
+      TicketLock__unlock(&wheel->lock);
+      return false;
+    }
+
+    RANGE(S64(0), S64(_4KB / sizeof(Timer))) {
+      page[it] = (Timer){.next = wheel->free, .pooled = true};
+      wheel->free = &page[it];
+    }
+  }
+
+  Timer *timer = wheel->free;
+  wheel->free = timer->next;
+  timer_arm(wheel, timer, task, delay_us, 0);
+
+  TicketLock__unlock(&wheel->lock);
+  return true;
+}
+
+static void cascade(TimerWheel *wheel, s64 level, u64 index) {
+  Timer *timer = wheel->slots[level][index];
+  wheel->slots[level][index] = NULL;
+
+  while (timer) {
+    Timer *next = timer->next;
+    wheel_insert(wheel, timer);
+    wheel->cascaded++;
+    timer = next;
+  }
+}
+
+// Queues fired tasks while holding the wheel's lock; queueing only takes the
+// task system's locks, which never wait on a wheel.
+static void flush_fired(TaskData *fired, s64 *count, s64 *one_shots) {
+  assert(add_tasks(fired, *count), "out of memory for queueing timer tasks");
+
+  // Only once they're counted as outstanding, so the task system can't think
+  // it's finished in between
+  a_add_rel(&TimerGlobals.pending, -*one_shots);
+  *count = 0;
+  *one_shots = 0;
+}
+
+void timers_advance(void) {
+  TimerWheel *wheel = &TimerGlobals.wheels[cpu_index()];
+  const u64 ticks = wheel_ticks(wheel);
+  if (wheel->now == ticks) return;
+
+  TaskData fired[FIRE_BATCH];
+  s64 count = 0, one_shots = 0;
+
+  TicketLock__lock(&wheel->lock);
+  while (wheel->now != ticks) {
+    const u64 now = ++wheel->now;
+
+    // Higher levels first, since what they cascade can land in a lower level's
+    // slot that's also due
+    for (s64 level = WHEEL_LEVELS - 1; level > 0; level--) {
+      const u64 shift = U64(WHEEL_SLOT_BITS * level);
+      if (now & ((U64(1) << shift) - 1)) continue;
+
+      cascade(wheel, level, (now >> shift) & WHEEL_MASK);
+    }
+
+    Timer *timer = wheel->slots[0][now & WHEEL_MASK];
+    wheel->slots[0][now & WHEEL_MASK] = NULL;
+
+    while (timer) {
+      Timer *next = timer->next;
+      fired[count++] = timer->task;
+      wheel->fired++;
+
+      if (timer->period) {
+        // Skip the periods this core was too busy to notice
+        timer->expires += timer->period;
+        if (timer->expires <= now) timer->expires = now + timer->period;
+        wheel_insert(wheel, timer);
+      } else {
+        a_store_rlx(&timer->wheel, NULL);
+        one_shots++;
+
+        if (timer->pooled) {
+          timer->next = wheel->free;
+          wheel->free = timer;
+        }
+      }
+
+      if (count == FIRE_BATCH) flush_fired(fired, &count, &one_shots);
+      timer = next;
+    }
+  }
+
+  if (count) flush_fired(fired, &count, &one_shots);
+  TicketLock__unlock(&wheel->lock);
+}
+
+s64 timers_pending(void) {
+  return a_load_acq(&TimerGlobals.pending);
+}
+
+TimerStats timer_stats(void) {
+  TimerStats stats = {0};
+  FOR_PTR(TimerGlobals.wheels, TimerGlobals.wheel_count) {
+    TicketLock__lock(&it->lock);
+    stats.started += it->started;
+    stats.fired += it->fired;
+    stats.cancelled += it->cancelled;
+    stats.cascaded += it->cascaded;
+    TicketLock__unlock(&it->lock);
+  }
+
+  return stats;
+}
@@ -0,0 +1,234 @@
+#include "tlb.h"
+#include "apic.h"
+#include "asm.h"
+#include "cpu.h"
+#include "init.h"
+#include "interrupts.h"
+#include "memory.h"
+#include <basics.h>
+#include <macros.h>
+#include <sync.h>
+
+typedef struct {
+  PageTable4 *p4; // NULL for kernel-half addresses, which every table maps
+  TlbRange range;
+} TlbRequest;
+
+// Invalidations waiting to be run on a particular core. Other cores append to
+// it and then send at most one IPI, until the core has emptied it again.
+typedef struct {
+  _Atomic u8 lock;
+  _Atomic bool online;
+  bool ipi_pending;
+  bool flush_all;
+  s32 count;
+  TlbRequest requests[TLB_BATCH_SIZE];
+
+  _Atomic s64 requested;
+  _Atomic s64 completed;
+
+  s64 ipis_sent;
+  s64 pages_invalidated;
+  s64 full_flushes;
+} CACHE_ALIGNED TlbMailbox;
+
+static TlbMailbox Mailboxes[CPU_MAX];
+
+static void handle_requests(void);
+static HANDLER Idt__tlb_shootdown(ExceptionStackFrame *frame);
+
+void tlb__init(void) {
+  set_interrupt_handler(INT_TLB_SHOOTDOWN, Idt__tlb_shootdown);
+  log_fmt("tlb shootdown INIT_COMPLETE");
+}
+
+void tlb__init_core(void) {
+  a_store(&Mailboxes[cpu_index()].online, true);
+}
+
+TlbStats tlb_stats(void) {
+  TlbStats stats = {0};
+  FOR_PTR(Mailboxes, cpu_count()) {
+    stats.ipis_sent += it->ipis_sent;
+    stats.pages_invalidated += it->pages_invalidated;
+    stats.full_flushes += it->full_flushes;
+  }
+
+  return stats;
+}
+
+TlbBatch TlbBatch__new(PageTable4 *p4) {
+  return (TlbBatch){.p4 = p4, .kernel = false, .flush_all = false, .count = 0};
+}
+
+void TlbBatch__add(TlbBatch *batch, u64 virt, s64 count) {
+  assert(count > 0);
+
+  virt = align_down(virt, _4KB);
+  const bool kernel = virt >= MEMORY__KERNEL_SPACE_BEGIN;
+  batch->kernel |= kernel;
+  if (batch->flush_all) return;
+
+  if (batch->count > 0) {
+    TlbRange *last = &batch->ranges[batch->count - 1];
+    const bool last_kernel = last->begin >= MEMORY__KERNEL_SPACE_BEGIN;
+    if (last_kernel == kernel && last->begin + U64(last->count) * _4KB == virt) {
+      last->count += count;
+      return;
+    }
+  }
+
+  if (batch->count == TLB_BATCH_SIZE) {
+    batch->flush_all = true;
+    return;
+  }
+
+  batch->ranges[batch->count++] = (TlbRange){.begin = virt, .count = count};
+}
+
+static u64 TlbMailbox__lock(TlbMailbox *box) {
+  // The shootdown handler takes this lock too, so interrupts have to stay off
+  // while it's held.
+  const u64 flags = irq_save();
+  while (!Mutex__try_lock(&box->lock))
+    pause();
+
+  return flags;
+}
+
+static void TlbMailbox__unlock(TlbMailbox *box, u64 flags) {
+  Mutex__unlock(&box->lock);
+  irq_restore(flags);
+}
+
+// Returns the ticket the batch is done at: once `completed` reaches it, the
+// core has run the invalidations, or a full flush instead.
+static s64 TlbMailbox__push(TlbMailbox *box, const TlbBatch *batch) {
+  // An overflowing batch still takes a ticket, or the waiter would see the
+  // mailbox as caught up before the flush had run
+  if (batch->flush_all || box->count + batch->count > TLB_BATCH_SIZE) {
+    box->flush_all = true;
+  } else {
+    FOR_PTR(batch->ranges, batch->count) {
+      const bool kernel = it->begin >= MEMORY__KERNEL_SPACE_BEGIN;
+      box->requests[box->count++] = (TlbRequest){.p4 = kernel ? NULL : batch->p4, .range = *it};
+    }
+  }
+
+  return a_add(&box->requested, 1) + 1;
+}
+
+void TlbBatch__flush(TlbBatch *batch) {
+  if (batch->count == 0 && !batch->flush_all) return;
+
+  // A thread that got moved partway through would flush its new core instead
+  // of the one it pushed to, and the old one would never run the invalidation
+  preempt_disable();
+  const s64 self = cpu_index(), count = cpu_count();
+  s64 tickets[CPU_MAX] = {0}; // 0 for cores that weren't sent anything
+
+  RANGE(S64(0), count, cpu) {
+    TlbMailbox *box = &Mailboxes[cpu];
+    if (cpu == self || !a_load(&box->online)) continue;
+
+    // Cores that only have the table cached under an idle PCID can just drop
+    // it; this has to happen before checking `active_page_table`, see
+    // `set_page_table`.
+    if (!batch->kernel) {
+      pcid_forget(cpu, batch->p4);
+      if (active_page_table(cpu) != batch->p4) continue;
+    }
+
+    const u64 flags = TlbMailbox__lock(box);
+    tickets[cpu] = TlbMailbox__push(box, batch);
+    const bool send_ipi = !box->ipi_pending;
+    box->ipi_pending = true;
+    TlbMailbox__unlock(box, flags);
+
+    if (send_ipi) {
+      apic_send_ipi(cpu_of(cpu)->core_id, INT_TLB_SHOOTDOWN);
+      Mailboxes[self].ipis_sent++;
+    }
+  }
+
+  // The current core goes through its own mailbox, without the IPI
+  TlbMailbox *box = &Mailboxes[self];
+  const u64 flags = TlbMailbox__lock(box);
+  TlbMailbox__push(box, batch);
+  TlbMailbox__unlock(box, flags);
+  handle_requests();
+
+  RANGE(S64(0), count, cpu) {
+    if (!tickets[cpu]) continue;
+
+    // Keep answering shootdowns aimed at this core while waiting, otherwise two
+    // cores flushing at each other with interrupts disabled would deadlock.
+    // Only this batch's ticket matters; other flushers keep moving `requested`.
+    TlbMailbox *target = &Mailboxes[cpu];
+    while (a_load(&target->completed) < tickets[cpu]) {
+      handle_requests();
+      pause();
+    }
+  }
+
+  preempt_enable();
+  *batch = TlbBatch__new(batch->p4);
+}
+
+// Run invalidations on the current core, with interrupts disabled
+static void invalidate_local(s64 self, TlbMailbox *box) {
+  PageTable4 *const active = active_page_table(self);
+
+  s64 pages = 0;
+  bool kernel = false;
+  FOR_PTR(box->requests, box->count) {
+    if (it->p4 != NULL && it->p4 != active) {
+      pcid_forget(self, it->p4);
+      continue;
+    }
+
+    kernel |= it->p4 == NULL;
+    pages += it->range.count;
+  }
+
+  if (box->flush_all || pages > TLB_FLUSH_THRESHOLD) {
+    flush_tlb();
+    pcid_forget(self, NULL);
+    box->full_flushes++;
+    return;
+  }
+
+  FOR_PTR(box->requests, box->count) {
+    if (it->p4 != NULL && it->p4 != active) continue;
+
+    for (s64 page = 0; page < it->range.count; page++)
+      invlpg(it->range.begin + U64(page) * _4KB);
+  }
+
+  box->pages_invalidated += pages;
+
+  // `invlpg` only reaches translations tagged with the current PCID, but kernel
+  // mappings are cached under all of them.
+  if (kernel) pcid_forget(self, NULL);
+}
+
+static void handle_requests(void) {
+  const s64 self = cpu_index();
+  TlbMailbox *box = &Mailboxes[self];
+  const u64 flags = TlbMailbox__lock(box);
+
+  if (box->count > 0 || box->flush_all) invalidate_local(self, box);
+
+  box->count = 0;
+  box->flush_all = false;
+  box->ipi_pending = false;
+  a_store(&box->completed, a_load(&box->requested));
+
+  TlbMailbox__unlock(box, flags);
+}
+
+static HANDLER Idt__tlb_shootdown(ExceptionStackFrame *frame) {
+  (void)frame;
+  handle_requests();
+  apic_eoi();
+}
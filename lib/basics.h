@@ -96,14 +96,15 @@ Bump Bump__new(s64 count) {
 }
 
 void *Bump__bump_impl(Bump *bump, s64 size, s64 align) {
-  s64 bump_index = a_load(&bump->index);
+  s64 bump_index = a_load_rlx(&bump->index);
   while (true) {
     s64 aligned_index = align_up(bump_index, align);
     s64 end_index = aligned_index + size;
     ensure(end_index <= bump->count) return NULL;
 
     u8 *ptr = bump->begin + aligned_index;
-    if (a_cxweak(&bump->index, &bump_index, end_index)) return ptr;
+    // Nothing is published through `index`; it just has to be handed out once
+    if (a_cxweak_rlx(&bump->index, &bump_index, end_index)) return ptr;
   }
 }
 
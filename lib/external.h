@@ -18,4 +18,9 @@ void ext__log_fmt(sloc loc, const char *fmt, s32 count, const any *args);
 // allocate zeroed pages
 void *ext__alloc_pages(s64 count);
 
+// Called by the locks in sync.h while they're held, so that whoever's holding
+// one doesn't get preempted and leave everyone else spinning. These nest.
+void ext__preempt_disable(void);
+void ext__preempt_enable(void);
+
 #endif
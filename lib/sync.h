@@ -1,6 +1,7 @@
 #ifndef __LIB_SYNC__
 #define __LIB_SYNC__
 #include <stdatomic.h>
+#include <external.h>
 #include <stddef.h>
 #include <types.h>
 
@@ -11,17 +12,92 @@
 #define a_load(obj)              __c11_atomic_load(obj, __ATOMIC_SEQ_CST)
 #define a_store(obj, value)      __c11_atomic_store(obj, value, __ATOMIC_SEQ_CST)
 #define a_add(obj, add)          __c11_atomic_fetch_add(obj, add, __ATOMIC_SEQ_CST)
+#define a_xchg(obj, value)       __c11_atomic_exchange(obj, value, __ATOMIC_SEQ_CST)
 #define a_cxweak(obj, expected, desired)                                                           \
   __c11_atomic_compare_exchange_weak(obj, expected, desired, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
 #define a_cxstrong(obj, expected, desired)                                                         \
   __c11_atomic_compare_exchange_strong(obj, expected, desired, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
 
+// Give data that's written by different cores its own cache line, so that the
+// cores don't steal the line from each other. Building with UNPADDED turns the
+// padding off, for measuring what it's worth.
+#define CACHE_LINE 64
+#ifdef UNPADDED
+#define CACHE_ALIGNED
+#else
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE)))
+#endif
+
+// Weaker orderings. The unsuffixed versions above are sequentially consistent,
+// and are the right default; use these only where the weaker ordering has been
+// worked out.
+//
+//   _rlx: no ordering, just atomicity
+//   _acq: later loads and stores can't move before this
+//   _rel: earlier loads and stores can't move after this
+//   _acqrel: both
+//
+// Failed compare-exchanges are relaxed, except for the _acq and _acqrel ones,
+// which acquire.
+#define a_load_rlx(obj)           __c11_atomic_load(obj, __ATOMIC_RELAXED)
+#define a_load_acq(obj)           __c11_atomic_load(obj, __ATOMIC_ACQUIRE)
+#define a_store_rlx(obj, value)   __c11_atomic_store(obj, value, __ATOMIC_RELAXED)
+#define a_store_rel(obj, value)   __c11_atomic_store(obj, value, __ATOMIC_RELEASE)
+#define a_add_rlx(obj, add)       __c11_atomic_fetch_add(obj, add, __ATOMIC_RELAXED)
+#define a_add_acq(obj, add)       __c11_atomic_fetch_add(obj, add, __ATOMIC_ACQUIRE)
+#define a_add_rel(obj, add)       __c11_atomic_fetch_add(obj, add, __ATOMIC_RELEASE)
+#define a_add_acqrel(obj, add)    __c11_atomic_fetch_add(obj, add, __ATOMIC_ACQ_REL)
+#define a_xchg_rlx(obj, value)    __c11_atomic_exchange(obj, value, __ATOMIC_RELAXED)
+#define a_xchg_acq(obj, value)    __c11_atomic_exchange(obj, value, __ATOMIC_ACQUIRE)
+#define a_xchg_rel(obj, value)    __c11_atomic_exchange(obj, value, __ATOMIC_RELEASE)
+#define a_xchg_acqrel(obj, value) __c11_atomic_exchange(obj, value, __ATOMIC_ACQ_REL)
+#define a_cxweak_rlx(obj, expected, desired)                                                       \
+  __c11_atomic_compare_exchange_weak(obj, expected, desired, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define a_cxweak_acq(obj, expected, desired)                                                       \
+  __c11_atomic_compare_exchange_weak(obj, expected, desired, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)
+#define a_cxweak_rel(obj, expected, desired)                                                       \
+  __c11_atomic_compare_exchange_weak(obj, expected, desired, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+#define a_cxweak_acqrel(obj, expected, desired)                                                    \
+  __c11_atomic_compare_exchange_weak(obj, expected, desired, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define a_cxstrong_rlx(obj, expected, desired)                                                     \
+  __c11_atomic_compare_exchange_strong(obj, expected, desired, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define a_cxstrong_acq(obj, expected, desired)                                                     \
+  __c11_atomic_compare_exchange_strong(obj, expected, desired, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)
+#define a_cxstrong_rel(obj, expected, desired)                                                     \
+  __c11_atomic_compare_exchange_strong(obj, expected, desired, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+#define a_cxstrong_acqrel(obj, expected, desired)                                                  \
+  __c11_atomic_compare_exchange_strong(obj, expected, desired, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+// Fences, for ordering relaxed operations. On x86, only the sequentially
+// consistent one emits an instruction (`mfence`); the others just stop the
+// compiler from reordering.
+#define a_fence_acq() __c11_atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define a_fence_rel() __c11_atomic_thread_fence(__ATOMIC_RELEASE)
+#define a_fence()     __c11_atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+// Stops the compiler from moving memory accesses across it, without any
+// hardware ordering.
+#define compiler_barrier() asm volatile("" : : : "memory")
+
+// Tell the core we're in a spin loop, so it doesn't flood the memory system
+// with speculative loads of the line we're waiting on
+#define spin_hint() __builtin_ia32_pause()
+
+// Exponential backoff for retrying a contended atomic. Each call spins for
+// `*delay` pauses and then doubles it, up to BACKOFF_MAX, so that the cores
+// that lost a race spread out instead of all retrying at once.
+#define BACKOFF_MAX 1024
+void backoff(s64 *delay);
+
 // NOTE: This ALSO breaks compatibility with GCC.
 //                                    - Albert Liu, Nov 15, 2021 Mon 19:03 EST
 #define spin_or(expr, spin)                                                                        \
-  for (s64 M_reps = 0; ({                                                                          \
+  for (s64 M_reps = 0, M_delay = 1; ({                                                             \
          if (expr) break;                                                                          \
-         if (M_reps++ < spin) continue;                                                            \
+         if (M_reps++ < spin) {                                                                    \
+           backoff(&M_delay);                                                                      \
+           continue;                                                                               \
+         }                                                                                         \
          true;                                                                                     \
        });                                                                                         \
        ({ break; }))
@@ -29,6 +105,76 @@
 bool Mutex__try_lock(_Atomic u8 *mtx);
 void Mutex__unlock(_Atomic u8 *mtx);
 
+// FIFO spinlock. Cores take a ticket and wait for it to be served, so nobody
+// starves, but every waiter still spins on the same `serving` line.
+typedef struct {
+  _Atomic u32 next;
+  _Atomic u32 serving;
+} TicketLock;
+
+void TicketLock__lock(TicketLock *lock);
+bool TicketLock__try_lock(TicketLock *lock);
+void TicketLock__unlock(TicketLock *lock);
+
+// Mellor-Crummey & Scott queue lock. Each waiter brings its own node and spins
+// on that, so a release only touches the next waiter's line. The node has to
+// stay alive until the matching unlock.
+typedef struct McsNode {
+  struct McsNode *_Atomic next;
+  _Atomic bool locked;
+} CACHE_ALIGNED McsNode;
+
+typedef struct {
+  McsNode *_Atomic tail;
+} McsLock;
+
+void McsLock__lock(McsLock *lock, McsNode *node);
+bool McsLock__try_lock(McsLock *lock, McsNode *node);
+void McsLock__unlock(McsLock *lock, McsNode *node);
+
+// Reader-writer lock for read-mostly data. Each reader only writes its own
+// slot's line, and only reads the writer's, so readers on different cores
+// never pull a shared line into exclusive mode. Writers set `writer` to stop
+// new readers, then wait for every slot to drain, so they're expensive and
+// can't be starved.
+//
+// Callers pass their core index as `slot`; cores past RWLOCK_SLOTS share slots,
+// which is still correct, just slower.
+#define RWLOCK_SLOTS 64
+
+typedef struct {
+  CACHE_ALIGNED _Atomic bool writer;
+  struct {
+    CACHE_ALIGNED _Atomic s64 readers;
+  } slots[RWLOCK_SLOTS];
+} RwLock;
+
+void RwLock__read_lock(RwLock *lock, s64 slot);
+void RwLock__read_unlock(RwLock *lock, s64 slot);
+void RwLock__write_lock(RwLock *lock);
+void RwLock__write_unlock(RwLock *lock);
+
+// Sequence lock, for small snapshots like clocks and stats. Writers make the
+// sequence odd while they work; readers never write anything, and just retry
+// if the sequence was odd or moved while they were copying:
+//
+//   u64 seq;
+//   do {
+//     seq = SeqLock__read_begin(&lock);
+//     snapshot = data;
+//   } while (SeqLock__read_retry(&lock, seq));
+//
+// Readers can see torn data inside the loop, so they should only copy it out,
+// not follow pointers in it. Writers exclude each other.
+typedef struct {
+  _Atomic u64 seq;
+} SeqLock;
+
+u64 SeqLock__read_begin(SeqLock *lock);
+bool SeqLock__read_retry(SeqLock *lock, u64 seq);
+void SeqLock__write_begin(SeqLock *lock);
+void SeqLock__write_end(SeqLock *lock);
+
 // NOTE: This breaks compatibility with GCC. I guess that's fine, but like, seems
 // weird and a bit uncomfy.
 //                                    - Albert Liu, Nov 15, 2021 Mon 18:36 EST
@@ -38,17 +184,201 @@ void Mutex__unlock(_Atomic u8 *mtx);
          break;                                                                                    \
        }))
 
+// Unlike CRITICAL, these wait for the lock instead of skipping the block.
+// Don't `break` or `return` out of them; the unlock is in the loop step.
+#define TICKET_CRITICAL(lock)                                                                      \
+  for (TicketLock *M_lock = (lock); (TicketLock__lock(M_lock), true); ({                           \
+         TicketLock__unlock(M_lock);                                                               \
+         break;                                                                                    \
+       }))
+
+#define MCS_CRITICAL(mcs_lock)                                                                     \
+  for (struct {                                                                                    \
+         McsLock *lock;                                                                            \
+         McsNode node;                                                                             \
+       } M_mcs = {.lock = (mcs_lock)};                                                             \
+       (McsLock__lock(M_mcs.lock, &M_mcs.node), true); ({                                          \
+         McsLock__unlock(M_mcs.lock, &M_mcs.node);                                                 \
+         break;                                                                                    \
+       }))
+
 #endif
 
 #ifdef __DUMBOSS_IMPL__
 
 bool Mutex__try_lock(_Atomic u8 *mtx) {
+  ext__preempt_disable();
+
   u8 current = 0;
-  return a_cxweak(mtx, &current, 1);
+  if (a_cxweak_acq(mtx, &current, 1)) return true;
+
+  ext__preempt_enable();
+  return false;
 }
 
 void Mutex__unlock(_Atomic u8 *mtx) {
-  a_store(mtx, 0);
+  a_store_rel(mtx, 0);
+  ext__preempt_enable();
+}
+
+void backoff(s64 *delay) {
+  for (s64 i = 0; i < *delay; i++)
+    spin_hint();
+
+  if (*delay < BACKOFF_MAX) *delay *= 2;
+}
+
+void TicketLock__lock(TicketLock *lock) {
+  ext__preempt_disable();
+  const u32 ticket = a_add_rlx(&lock->next, 1);
+
+  // Back off in proportion to our place in line; everyone ahead of us needs at
+  // least a critical section's worth of time
+  while (true) {
+    const u32 serving = a_load_acq(&lock->serving);
+    if (serving == ticket) return;
+
+    for (u32 i = 0; i < (ticket - serving) * 16; i++)
+      spin_hint();
+  }
+}
+
+bool TicketLock__try_lock(TicketLock *lock) {
+  // The lock is free exactly when nobody holds a ticket that isn't served yet
+  ext__preempt_disable();
+
+  u32 ticket = a_load_rlx(&lock->serving);
+  if (a_cxstrong_acq(&lock->next, &ticket, ticket + 1)) return true;
+
+  ext__preempt_enable();
+  return false;
+}
+
+void TicketLock__unlock(TicketLock *lock) {
+  // Only the holder writes `serving`, so this doesn't need to be an RMW
+  a_store_rel(&lock->serving, a_load_rlx(&lock->serving) + 1);
+  ext__preempt_enable();
+}
+
+void McsLock__lock(McsLock *lock, McsNode *node) {
+  ext__preempt_disable();
+  a_store_rlx(&node->next, NULL);
+  a_store_rlx(&node->locked, true);
+
+  McsNode *prev = a_xchg_acqrel(&lock->tail, node);
+  if (prev == NULL) return;
+
+  a_store_rel(&prev->next, node);
+  while (a_load_acq(&node->locked))
+    spin_hint();
+}
+
+bool McsLock__try_lock(McsLock *lock, McsNode *node) {
+  a_store_rlx(&node->next, NULL);
+  a_store_rlx(&node->locked, true);
+
+  ext__preempt_disable();
+
+  McsNode *expected = NULL;
+  if (a_cxstrong_acq(&lock->tail, &expected, node)) return true;
+
+  ext__preempt_enable();
+  return false;
+}
+
+void McsLock__unlock(McsLock *lock, McsNode *node) {
+  McsNode *next = a_load_acq(&node->next);
+  if (next == NULL) {
+    McsNode *expected = node;
+    if (a_cxstrong_rel(&lock->tail, &expected, NULL)) {
+      ext__preempt_enable();
+      return;
+    }
+
+    // Someone swapped themselves in behind us, but hasn't linked up yet
+    while ((next = a_load_acq(&node->next)) == NULL)
+      spin_hint();
+  }
+
+  a_store_rel(&next->locked, false);
+  ext__preempt_enable();
+}
+
+void RwLock__read_lock(RwLock *lock, s64 slot) {
+  _Atomic s64 *readers = &lock->slots[slot % RWLOCK_SLOTS].readers;
+  ext__preempt_disable();
+
+  while (true) {
+    // Has to be ordered before the load of `writer`, or a reader and a writer
+    // could both miss each other
+    a_add(readers, 1);
+    if (!a_load(&lock->writer)) return;
+
+    a_add_rlx(readers, -1);
+    while (a_load_rlx(&lock->writer))
+      spin_hint();
+  }
+}
+
+void RwLock__read_unlock(RwLock *lock, s64 slot) {
+  a_add_rel(&lock->slots[slot % RWLOCK_SLOTS].readers, -1);
+  ext__preempt_enable();
+}
+
+void RwLock__write_lock(RwLock *lock) {
+  ext__preempt_disable();
+
+  s64 delay = 1;
+  bool expected = false;
+  while (!a_cxweak(&lock->writer, &expected, true)) {
+    expected = false;
+    backoff(&delay);
+  }
+
+  for (s64 i = 0; i < RWLOCK_SLOTS; i++) {
+    while (a_load_acq(&lock->slots[i].readers))
+      spin_hint();
+  }
+}
+
+void RwLock__write_unlock(RwLock *lock) {
+  a_store_rel(&lock->writer, false);
+  ext__preempt_enable();
+}
+
+u64 SeqLock__read_begin(SeqLock *lock) {
+  while (true) {
+    const u64 seq = a_load_acq(&lock->seq);
+    if (!(seq & 1)) return seq;
+
+    spin_hint();
+  }
+}
+
+bool SeqLock__read_retry(SeqLock *lock, u64 seq) {
+  // Keeps the reads of the data from moving after the re-check
+  a_fence_acq();
+  return a_load_rlx(&lock->seq) != seq;
+}
+
+void SeqLock__write_begin(SeqLock *lock) {
+  ext__preempt_disable();
+
+  u64 seq = a_load_rlx(&lock->seq);
+  while (true) {
+    if (!(seq & 1) && a_cxweak_acq(&lock->seq, &seq, seq + 1)) break;
+
+    spin_hint();
+    seq = a_load_rlx(&lock->seq);
+  }
+
+  // Keeps the writes to the data from moving before the sequence goes odd
+  a_fence_rel();
+}
+
+void SeqLock__write_end(SeqLock *lock) {
+  a_store_rel(&lock->seq, a_load_rlx(&lock->seq) + 1);
+  ext__preempt_enable();
 }
 
 _Static_assert(sizeof(_Atomic s64) == 8, "atomics are zero-cost right?? :)");